@@ -7,15 +7,32 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <ncurses.h>
 
 #include "ashmem.h"
 #include "share_file.h"
+#include "ashmem_app.h"
+#include "ashmem_cache.h"
+#include "ashmem_arena.h"
+#include "ashmem_queue.h"
 
 #define ASHMEM_DEVICE	"/dev/ashmem"
 #define SHFILE_DEVICE   "/dev/shfile"
 #define NAME		"ashmem_test"
 #define LENGTH		4096
+#define SHFILE_LENGTH	(64 * 4096)
+#define SHFILE_ENTRIES	"/sys/kernel/debug/shfile/entries"
 
 int ashmem_open(const char *name, size_t size)
 {
@@ -26,7 +43,8 @@ int ashmem_open(const char *name, size_t size)
 	if (fd < 0)
 		return fd;
 
-	strncpy(buf, name, sizeof(name) + 1);
+	strncpy(buf, name, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
 	ret = ioctl(fd, ASHMEM_SET_NAME, buf);
 	if (ret < 0)
 		goto error;
@@ -80,7 +98,7 @@ int ashmem_write_bytes(int fd, unsigned int *address, unsigned char *buffer, int
 	return count;
 }
 
-int ashmem_set_fd(int fd_shmem)
+int ashmem_set_fd(int fd_shmem, int *shfile_fd)
 {
 	int fd, ret;
 	
@@ -90,14 +108,18 @@ int ashmem_set_fd(int fd_shmem)
 
 	ret = ioctl(fd, SHFILE_SHARE_FD, &fd_shmem);
 	if (ret < 0)
+	{
+		close(fd);
 		return ret;
+	}
 
-	close(fd);
+	/* closing it unpublishes */
+	*shfile_fd = fd;
 
 	return 0;
 }
 
-int ashmem_get_fd(void)
+int ashmem_get_fd(int *shfile_fd)
 {
 	int fd, ret;
 	int fd_shmem;
@@ -113,9 +135,10 @@ int ashmem_get_fd(void)
 	if (ret < 0)
 	{
 		printf("failed to get shmem fd\n");
+		close(fd);
 		return ret;
 	}
-	close(fd);
+	*shfile_fd = fd;
 
 	printf("get shmem fd=%d\n", fd_shmem);
 	return fd_shmem;
@@ -160,113 +183,709 @@ int test_ashmem(void)
 	return ret;
 }
 
+#define CACHE_NAME	"ashmem_cache_test"
+#define CACHE_SLOTS	16
+#define CACHE_KEYS	24
 
-int shfile_server(void)
+static int cache_fill(unsigned long key, void *buf, size_t size, void *arg)
+{
+	unsigned long *fills = arg;
+
+	/* stands in for an expensive decode */
+	snprintf(buf, size, "object %lu", key);
+	(*fills)++;
+
+	return 0;
+}
+
+int test_ashmem_cache(void)
+{
+	struct ashmem_cache	*cache;
+	unsigned long		 fills = 0;
+	unsigned long		 key;
+	int			 round;
+
+	cache = ashmem_cache_create(CACHE_NAME, CACHE_SLOTS, LENGTH, cache_fill, &fills);
+	if (!cache)
+	{
+		printf("create ashmem cache error\n");
+		return -1;
+	}
+
+	for (round = 0; round < 4; round++)
+	{
+		/* purge everything unpinned before the last round */
+		if (round == 3 && ioctl(cache->fd, ASHMEM_PURGE_ALL_CACHES, NULL) < 0)
+			printf("purge all caches failed (needs CAP_SYS_ADMIN)\n");
+
+		for (key = 0; key < CACHE_KEYS; key++)
+		{
+			char *obj = ashmem_cache_get(cache, key);
+
+			if (!obj)
+				continue;
+			if (strtoul(obj + strlen("object "), NULL, 10) != key)
+				printf("bad object for key %lu: %s\n", key, obj);
+			ashmem_cache_put(cache, key);
+		}
+	}
+
+	printf("fill called %lu times\n", fills);
+	ashmem_cache_print_stats(cache);
+	ashmem_cache_destroy(cache);
+
+	return 0;
+}
+
+#define SHFILE_MSG_SIZE		48
+#define SHFILE_QUEUE_SLOTS	1024
+#define BENCH_MESSAGES		1000000
+#define BENCH_BATCH		32
+#define BENCH_END		(~0ULL)
+#define BENCH_BUCKETS		64
+
+/* found through the arena root of the shared region */
+struct shfile_root
+{
+	uint32_t	greeting;	/* string written by the server */
+	uint32_t	queue;		/* client -> server messages */
+};
+
+struct shfile_map
+{
+	int			 fd;
+	int			 shfile_fd;	/* keeps fd published (server) or referenced (client) */
+	unsigned int		*addr;
+	size_t			 size;
+	struct ashmem_arena	 arena;
+	struct shfile_root	*root;
+	struct ashmem_queue	*queue;
+};
+
+struct bench_msg
+{
+	uint64_t	seq;
+	int64_t		send_ns;
+};
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int shfile_map_server(struct shfile_map *map)
 {
-	int		 fd, ret;
-	unsigned int	*mAddress;
 	unsigned char	*buf  = "ashmem test";
 	unsigned char	 read_buf[30];
 	unsigned int	 size =	0;
+	unsigned int	 pages;
+	uint32_t	 off;
+	int		 ret;
 
-	fd = ashmem_open(NAME, LENGTH);
-	if (fd < 0)
+	memset(map, 0, sizeof(*map));
+	map->size = SHFILE_LENGTH;
+
+	map->fd = ashmem_open(NAME, SHFILE_LENGTH);
+	if (map->fd < 0)
+	{
 		printf("open ashmem error\n");
+		return -1;
+	}
 
-	size = ioctl(fd, ASHMEM_GET_SIZE, NULL);
+	size = ioctl(map->fd, ASHMEM_GET_SIZE, NULL);
 	printf("size=%d\n", size);
 	
-	mAddress = (unsigned int *)mmap(NULL, LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (mAddress < 0)
+	map->addr = (unsigned int *)mmap(NULL, SHFILE_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (map->addr == MAP_FAILED)
+	{
 		printf("mmap failed\n");
+		close(map->fd);
+		return -1;
+	}
 
-	ret = ashmem_write_bytes(fd, mAddress, buf, 0, 0, strlen(buf) + 1);
+	if (ashmem_arena_format(map->addr, SHFILE_LENGTH) < 0 ||
+	    ashmem_arena_attach(&map->arena, map->addr, SHFILE_LENGTH) < 0)
+	{
+		printf("arena init failed\n");
+		goto err;
+	}
+
+	off = ashmem_arena_alloc(&map->arena, sizeof(*map->root));
+	map->root = ashmem_arena_ptr(&map->arena, off);
+	if (!map->root)
+	{
+		printf("arena alloc failed\n");
+		goto err;
+	}
+
+	pages = (ashmem_queue_bytes(SHFILE_QUEUE_SLOTS, SHFILE_MSG_SIZE) + ARENA_PAGE_SIZE - 1) / ARENA_PAGE_SIZE;
+	map->root->queue = ashmem_arena_alloc_pages(&map->arena, pages);
+	map->queue = ashmem_arena_ptr(&map->arena, map->root->queue);
+	if (!map->queue || ashmem_queue_init(map->queue, SHFILE_QUEUE_SLOTS, SHFILE_MSG_SIZE) < 0)
+	{
+		printf("queue init failed\n");
+		goto err;
+	}
+
+	/* offset 0 is the arena header, never write through a failed alloc */
+	map->root->greeting = ashmem_arena_alloc(&map->arena, strlen(buf) + 1);
+	if (!map->root->greeting)
+	{
+		printf("arena alloc failed\n");
+		goto err;
+	}
+
+	ret = ashmem_write_bytes(map->fd, map->addr, buf, 0, map->root->greeting, strlen(buf) + 1);
 	if (ret < 0)
 	 	printf("write failed\n");
 
-	ashmem_read_bytes(fd, mAddress, read_buf, 0, 0, strlen(buf) + 1); 
+	ret = ashmem_read_bytes(map->fd, map->addr, read_buf, 0, map->root->greeting, strlen(buf) + 1);
 	if (ret < 0) 
 	 	printf("read failed"); 
 	printf("read data: %s\n", read_buf);
 
-	ashmem_set_fd(fd);
+	/* clients find everything through the arena root */
+	ashmem_arena_set_root(&map->arena, off);
+
+	if (ashmem_set_fd(map->fd, &map->shfile_fd) < 0)
+	{
+		printf("failed to publish shmem fd\n");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	munmap((void *)map->addr, SHFILE_LENGTH);
+	close(map->fd);
+	return -1;
+}
+
+static int shfile_map_client(struct shfile_map *map)
+{
+	uint32_t off;
+
+	memset(map, 0, sizeof(*map));
+
+	map->fd = ashmem_get_fd(&map->shfile_fd);
+	if (map->fd < 0)
+		return -1;
+
+	map->size = ioctl(map->fd, ASHMEM_GET_SIZE, NULL);
+	printf("size=%zu\n", map->size);
+	
+	map->addr = (unsigned int *)mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (map->addr == MAP_FAILED)
+	{
+		printf("mmap failed\n");
+		close(map->fd);
+		close(map->shfile_fd);
+		return -1;
+	}
+
+	off = 0;
+	if (ashmem_arena_attach(&map->arena, map->addr, map->size) == 0)
+		off = ashmem_arena_get_root(&map->arena);
+	map->root = ashmem_arena_ptr(&map->arena, off);
+	if (map->root)
+		map->queue = ashmem_arena_ptr(&map->arena, map->root->queue);
+
+	if (!map->queue || ashmem_queue_check(map->queue) < 0)
+	{
+		printf("no message queue in shared region\n");
+		munmap((void *)map->addr, map->size);
+		close(map->fd);
+		close(map->shfile_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int shfile_unmap(struct shfile_map *map)
+{
+	int ret;
+
+	ashmem_arena_detach(&map->arena);
+	ashmem_unpin_region(map->fd, 0, 0); 
+
+	ret = munmap((void *)map->addr, map->size);
+	if (ret < 0)
+		printf("unmap failed\n");
+	
+	close(map->fd);
+	close(map->shfile_fd);
+
+	return ret;
+}
+
+#define SERVER_TICK_MS		1000
+
+struct shfile_server_ctx
+{
+	struct ashmem_queue	*queue;
+	int			 notify_fd;	/* eventfd: messages are waiting */
+	int			 ack_fd;	/* eventfd: queue drained by the main loop */
+	int			 stop;
+	unsigned long		 wakeups;	/* futex returns in the watcher */
+};
+
+/*
+ * The queue sleeps on a futex which epoll cannot wait for, so a watcher
+ * thread turns "queue not empty" into an eventfd event.  It waits for the
+ * main loop to drain the queue before sleeping again, both threads stay
+ * blocked while no client talks to us.
+ */
+static void *shfile_queue_watch(void *arg)
+{
+	struct shfile_server_ctx	*ctx = arg;
+	uint64_t			 val = 1;
+
+	while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+	{
+		if (ashmem_queue_wait(ctx->queue, -1) == -ESHUTDOWN)
+			break;
+		__atomic_add_fetch(&ctx->wakeups, 1, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		if (write(ctx->notify_fd, &val, sizeof(val)) < 0 ||
+		    read(ctx->ack_fd, &val, sizeof(val)) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int shfile_arm_timer(int fd, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec	= ms / 1000;
+	its.it_value.tv_nsec	= (ms % 1000) * 1000000;
+	its.it_interval		= its.it_value;
+
+	return timerfd_settime(fd, 0, &its, NULL);
+}
+
+static int shfile_epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+
+	ev.events  = EPOLLIN;
+	ev.data.fd = fd;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int shfile_server(void)
+{
+	struct shfile_map		 map;
+	struct shfile_server_ctx	 ctx;
+	struct epoll_event		 events[4];
+	char				 msgs[BENCH_BATCH][SHFILE_MSG_SIZE];
+	uint32_t			 lens[BENCH_BATCH];
+	unsigned long			 received = 0, wakeups = 0, last_wakeups = 0;
+	int64_t				 start, last_tick;
+	double				 rate = 0;
+	int				 epfd, timer_fd, timer_armed = 0, active = 0;
+	int				 quit = 0, ret = -1;
+	pthread_t			 watcher;
+	uint64_t			 val;
+	unsigned int			 n;
+	int				 i, nr;
+
+	if (shfile_map_server(&map) < 0)
+		return -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.queue     = map.queue;
+	ctx.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ctx.ack_fd    = eventfd(0, EFD_CLOEXEC);
+	timer_fd      = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	epfd	      = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx.notify_fd < 0 || ctx.ack_fd < 0 || timer_fd < 0 || epfd < 0 ||
+	    shfile_epoll_add(epfd, STDIN_FILENO) < 0 ||
+	    shfile_epoll_add(epfd, ctx.notify_fd) < 0 ||
+	    shfile_epoll_add(epfd, timer_fd) < 0)
+	{
+		printf("event setup failed\n");
+		goto out_close;
+	}
+
+	if (pthread_create(&watcher, NULL, shfile_queue_watch, &ctx))
+	{
+		printf("watcher thread failed\n");
+		goto out_close;
+	}
 
-	int key;
 	initscr();
 	cbreak();
 	keypad(stdscr, TRUE);
 	noecho();
-	timeout(1);
+	nodelay(stdscr, TRUE);
 
 	clear();
-	mvprintw(5,5, "server running:");
+	mvprintw(5,5, "server running, 'q' to quit:");
+	refresh();
 
-	while (1)
+	start = last_tick = now_ns();
+
+	while (!quit)
 	{
-		int i;
-	
-		move(7,0);
+		nr = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (nr < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		wakeups++;
+
+		for (i = 0; i < nr; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if (fd == STDIN_FILENO)
+			{
+				int key;
+
+				while ((key = getch()) != ERR)
+					if (key == 'q')
+						quit = 1;
+			}
+			else if (fd == ctx.notify_fd)
+			{
+				if (read(ctx.notify_fd, &val, sizeof(val)) < 0)
+					continue;
+
+				while ((n = ashmem_queue_recv_batch(map.queue, msgs, lens, BENCH_BATCH, 0)) > 0)
+				{
+					received += n;
+					msgs[n - 1][SHFILE_MSG_SIZE - 1] = '\0';
+					move(9, 0);
+					clrtoeol();
+					mvprintw(9, 5, "messages: %lu, last: %s", received, msgs[n - 1]);
+				}
+
+				val = 1;
+				if (write(ctx.ack_fd, &val, sizeof(val)) < 0)
+					quit = 1;
+
+				/* the rate display only ticks while there is something to show */
+				active = 1;
+				if (!timer_armed && shfile_arm_timer(timer_fd, SERVER_TICK_MS) == 0)
+					timer_armed = 1;
+			}
+			else if (fd == timer_fd)
+			{
+				int64_t now = now_ns();
+				unsigned long total;
+
+				if (read(timer_fd, &val, sizeof(val)) < 0)
+					continue;
+
+				total = wakeups + __atomic_load_n(&ctx.wakeups, __ATOMIC_RELAXED);
+				rate = (total - last_wakeups) * 1e9 / (now - last_tick);
+				last_wakeups = total;
+				last_tick = now;
+
+				if (!active && shfile_arm_timer(timer_fd, 0) == 0)
+					timer_armed = 0;
+				active = 0;
+			}
+		}
+
+		move(11, 0);
 		clrtoeol();
+		mvprintw(11, 5, "wakeups: %lu, %.1f/s while active",
+			 wakeups + __atomic_load_n(&ctx.wakeups, __ATOMIC_RELAXED), rate);
 		refresh();
+	}
+	endwin();
+
+	/* kick the watcher out of both of its blocking points, a full queue included */
+	__atomic_store_n(&ctx.stop, 1, __ATOMIC_RELEASE);
+	val = 1;
+	if (write(ctx.ack_fd, &val, sizeof(val)) < 0)
+		printf("failed to stop watcher\n");
+	ashmem_queue_close(map.queue);
+	pthread_join(watcher, NULL);
+
+	wakeups += ctx.wakeups;
+	printf("%lu messages, %lu wakeups in %.1f s (%.2f/s)\n", received, wakeups,
+	       (now_ns() - start) / 1e9, wakeups * 1e9 / (now_ns() - start));
+	ret = 0;
+
+out_close:
+	if (epfd >= 0)
+		close(epfd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (ctx.ack_fd >= 0)
+		close(ctx.ack_fd);
+	if (ctx.notify_fd >= 0)
+		close(ctx.notify_fd);
+
+	return shfile_unmap(&map) < 0 ? -1 : ret;
+}
+
+int shfile_client(void)
+{
+	struct shfile_map	 map;
+	unsigned char		 read_buf[30];
+	char			 msg[SHFILE_MSG_SIZE];
+	int			 ret;
+
+	if (shfile_map_client(&map) < 0)
+		return -1;
+
+	if (map.root->greeting)
+	{
+		ret = ashmem_read_bytes(map.fd, map.addr, read_buf, 0, map.root->greeting, sizeof(read_buf));
+		if (ret < 0)
+			printf("read failed");
+		read_buf[sizeof(read_buf) - 1] = '\0';
+		printf("read data: %s\n", read_buf);
+	}
+
+	snprintf(msg, sizeof(msg), "hello from client %d", getpid());
+	if (ashmem_queue_send(map.queue, msg, strlen(msg) + 1) < 0)
+		printf("send failed\n");
+
+	ret = shfile_unmap(&map);
+
+	printf("shfile client closed\n");
 	
-		for (i = 0; i < 80; i++)
+	return ret;
+}
+
+/* log2 bucket: bucket i holds latencies up to 2^i ns */
+static int bench_bucket(int64_t lat)
+{
+	int i = 0;
+
+	while (i < BENCH_BUCKETS - 1 && (1LL << i) < lat)
+		i++;
+
+	return i;
+}
+
+/* smallest latency such that @pct percent of samples are at or below it (bucket upper bound) */
+static int64_t bench_percentile(unsigned long *hist, unsigned long count, int pct)
+{
+	unsigned long	want = (count * pct + 99) / 100;
+	unsigned long	seen = 0;
+	int		i;
+
+	for (i = 0; i < BENCH_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if (seen >= want)
+			return 1LL << i;
+	}
+
+	return 1LL << (BENCH_BUCKETS - 1);
+}
+
+/* consumer side: one-way latency and throughput of client -> server messages */
+int shfile_bench_server(void)
+{
+	struct shfile_map	 map;
+	char			 raw[BENCH_BATCH][SHFILE_MSG_SIZE];
+	struct bench_msg	 msg;
+	unsigned long		 hist[BENCH_BUCKETS] = { 0 };
+	unsigned long		 count = 0;
+	int64_t			 first = 0, last = 0, now, lat;
+	int64_t			 lat_min = INT64_MAX, lat_max = 0, lat_sum = 0;
+	unsigned int		 i, n;
+	int			 done = 0;
+
+	if (sizeof(struct bench_msg) > SHFILE_MSG_SIZE)
+		return -1;
+
+	if (shfile_map_server(&map) < 0)
+		return -1;
+
+	printf("waiting for \"ashmem_app bc\"\n");
+
+	while (!done)
+	{
+		n = ashmem_queue_recv_batch(map.queue, raw, NULL, BENCH_BATCH, -1);
+		now = now_ns();
+
+		for (i = 0; i < n; i++)
 		{
-			mvprintw(7, i, ".");
-			refresh();
-			usleep(50000);
-			key = getch();
-			if (key == 'q')
+			memcpy(&msg, raw[i], sizeof(msg));
+			if (msg.seq == BENCH_END)
+			{
+				done = 1;
 				break;
+			}
+
+			lat = now - msg.send_ns;
+			if (lat < 0)
+				lat = 0;
+			lat_sum += lat;
+			if (lat < lat_min)
+				lat_min = lat;
+			if (lat > lat_max)
+				lat_max = lat;
+			hist[bench_bucket(lat)]++;
+
+			if (!count++)
+				first = msg.send_ns;
+			last = now;
 		}
-		if (i < 80)
-			break;
+	}
 
+	if (count)
+	{
+		double secs = (last - first) / 1e9;
+
+		printf("received %lu messages in %.3f s: %.0f msgs/s\n",
+		       count, secs, secs > 0 ? count / secs : 0.0);
+		printf("one-way latency ns: min %lld avg %lld max %lld p50 <= %lld p99 <= %lld\n",
+		       (long long)lat_min, (long long)(lat_sum / count), (long long)lat_max,
+		       (long long)bench_percentile(hist, count, 50),
+		       (long long)bench_percentile(hist, count, 99));
 	}
-	endwin();
 
-	ashmem_unpin_region(fd, 0, 0); 
+	return shfile_unmap(&map);
+}
 
-	ret = munmap((void *)mAddress, LENGTH);
-	if (ret < 0)
-		printf("unmap failed\n");
-	
-	close(fd);
+/* producer side: publish @total timestamped messages in batches */
+int shfile_bench_client(unsigned long total)
+{
+	struct shfile_map	 map;
+	char			 raw[BENCH_BATCH][SHFILE_MSG_SIZE];
+	struct bench_msg	 msg;
+	unsigned long		 seq = 0, full = 0;
+	unsigned int		 i, n, sent;
+	int64_t			 start, ts;
+
+	if (shfile_map_client(&map) < 0)
+		return -1;
 
-	return ret;
+	start = now_ns();
+	while (seq < total)
+	{
+		n = total - seq < BENCH_BATCH ? total - seq : BENCH_BATCH;
+		ts = now_ns();
+		for (i = 0; i < n; i++)
+		{
+			msg.seq = seq + i;
+			msg.send_ns = ts;
+			memcpy(raw[i], &msg, sizeof(msg));
+		}
+
+		for (i = 0; i < n; i += sent)
+		{
+			sent = ashmem_queue_send_batch(map.queue, raw[i], SHFILE_MSG_SIZE, n - i);
+			if (!sent)
+			{
+				full++;
+				sched_yield();
+			}
+		}
+		seq += n;
+	}
+
+	msg.seq = BENCH_END;
+	msg.send_ns = now_ns();
+	while (ashmem_queue_send(map.queue, &msg, sizeof(msg)) < 0)
+		sched_yield();
+
+	printf("sent %lu messages in %.3f s, queue full %lu times\n",
+	       total, (now_ns() - start) / 1e9, full);
+
+	return shfile_unmap(&map);
 }
 
-int shfile_client(void)
+
+/* entries @pid has published, as listed in debugfs; -1 if it cannot be read */
+static int shfile_count_entries(pid_t pid)
 {
-	int		 fd, ret;
-	unsigned int	*mAddress;
-	unsigned char	*buf  = "ashmem test";
-	unsigned char	 read_buf[30];
-	unsigned int	 size =	0;
+	FILE		*fp;
+	char		 line[512];
+	unsigned long	 id;
+	int		 owner, count = 0;
 
-	fd = ashmem_get_fd();
+	fp = fopen(SHFILE_ENTRIES, "r");
+	if (!fp)
+		return -1;
 
-	size = ioctl(fd, ASHMEM_GET_SIZE, NULL);
-	printf("size=%d\n", size);
-	
-	mAddress = (unsigned int *)mmap(NULL, LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (mAddress < 0)
-		printf("mmap failed\n");
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%lu %d", &id, &owner) == 2 && owner == pid)
+			count++;
+	fclose(fp);
 
-	ashmem_read_bytes(fd, mAddress, read_buf, 0, 0, strlen(buf) + 1); 
-	if (ret < 0) 
-	 	printf("read failed"); 
-	printf("read data: %s\n", read_buf);
+	return count;
+}
 
+/*
+ * A publisher killed without closing its shfile handle must not leave its
+ * entry behind: the fd table going away releases the handle.
+ */
+int test_shfile_exit(void)
+{
+	int	pipefd[2];
+	int	before, after;
+	pid_t	pid;
+	char	c;
 
-	ret = munmap((void *)mAddress, LENGTH);
-	if (ret < 0)
-		printf("unmap failed\n");
+	if (pipe(pipefd) < 0)
+		return -1;
 
-	printf("shfile client closed\n");
-	
-	return ret;
-}
+	pid = fork();
+	if (pid < 0)
+	{
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		int fd, shfile_fd;
+
+		close(pipefd[0]);
+		fd = ashmem_open(NAME, LENGTH);
+		if (fd < 0 || ashmem_set_fd(fd, &shfile_fd) < 0)
+			_exit(1);
+		write(pipefd[1], "p", 1);
+		pause();
+		_exit(0);
+	}
+
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1)
+	{
+		printf("publisher failed\n");
+		close(pipefd[0]);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	close(pipefd[0]);
+
+	before = shfile_count_entries(pid);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	after = shfile_count_entries(pid);
+
+	printf("publisher %d: %d entries before SIGKILL, %d after\n", pid, before, after);
+	if (before != 1 || after != 0)
+	{
+		printf("FAIL\n");
+		return -1;
+	}
+	printf("PASS\n");
 
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -286,6 +905,27 @@ int main(int argc, char *argv[])
 		printf("run shfile client\n");
 		shfile_client();
 	}
+	else if (argc == 2 && !strcmp(argv[1], "m"))
+	{
+		printf("run ashmem cache test\n");
+		test_ashmem_cache();
+	}
+	else if (argc == 2 && !strcmp(argv[1], "k"))
+	{
+		printf("run shfile publisher exit test\n");
+		if (test_shfile_exit() < 0)
+			return 1;
+	}
+	else if (argc == 2 && !strcmp(argv[1], "bs"))
+	{
+		printf("run shfile queue benchmark server\n");
+		shfile_bench_server();
+	}
+	else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "bc"))
+	{
+		printf("run shfile queue benchmark client\n");
+		shfile_bench_client(argc == 3 ? strtoul(argv[2], NULL, 0) : BENCH_MESSAGES);
+	}
 	else
 		printf("error argument\n");
 
@@ -0,0 +1,17 @@
+#ifndef _ASHMEM_APP_H_
+#define _ASHMEM_APP_H_
+
+#include <stddef.h>
+
+int ashmem_open(const char *name, size_t size);
+int ashmem_pin_region(int fd, size_t offset, size_t len);
+int ashmem_unpin_region(int fd, size_t offset, size_t len);
+/*
+ * Publish @fd_shmem through /dev/shfile, or fetch the newest published fd.
+ * Both hand back the shfile handle in @shfile_fd: a published fd stays
+ * published and a fetched one stays referenced until it is closed.
+ */
+int ashmem_set_fd(int fd_shmem, int *shfile_fd);
+int ashmem_get_fd(int *shfile_fd);
+
+#endif /* _ASHMEM_APP_H_ */
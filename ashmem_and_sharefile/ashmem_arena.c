@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <string.h>
+
+#include "ashmem_arena.h"
+
+#define ARENA_MAGIC		0x616e7261	/* "arna" */
+#define ARENA_PAGE_FREE		0xff
+#define ARENA_PAGE_RUN		0xfe
+
+#define ARENA_OFF_MASK		0xffffffffULL
+#define ARENA_TAG_ONE		(1ULL << 32)
+
+struct ashmem_arena_class
+{
+	uint64_t	free_head;	/* low 32 bits: offset, high 32 bits: ABA tag */
+} __attribute__((aligned(ARENA_CACHELINE)));
+
+struct ashmem_arena_header
+{
+	uint32_t			magic;
+	uint32_t			size;
+	uint32_t			nr_pages;
+	uint32_t			root;
+	uint32_t			next_page __attribute__((aligned(ARENA_CACHELINE)));
+	struct ashmem_arena_class	classes[ARENA_NR_CLASSES];
+	uint8_t				page_class[];	/* owner class of every page */
+};
+
+static unsigned int arena_class_of(size_t size)
+{
+	unsigned int cls = 0;
+
+	while ((1U << (ARENA_MIN_SHIFT + cls)) < size)
+		cls++;
+
+	return cls;
+}
+
+static uint32_t arena_block_size(unsigned int cls)
+{
+	return 1U << (ARENA_MIN_SHIFT + cls);
+}
+
+static uint32_t *arena_link(struct ashmem_arena *arena, uint32_t off)
+{
+	return (uint32_t *)(arena->base + off);
+}
+
+static uint32_t arena_header_pages(uint32_t nr_pages)
+{
+	size_t len = sizeof(struct ashmem_arena_header) + nr_pages;
+
+	return (len + ARENA_PAGE_SIZE - 1) >> ARENA_PAGE_SHIFT;
+}
+
+/* push the chain first..last (already linked) onto a shared free list */
+static void arena_push_chain(struct ashmem_arena *arena, unsigned int cls,
+			     uint32_t first, uint32_t last)
+{
+	struct ashmem_arena_class	*c = &arena->hdr->classes[cls];
+	uint64_t			 head, next;
+
+	head = __atomic_load_n(&c->free_head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(arena_link(arena, last), (uint32_t)head, __ATOMIC_RELAXED);
+		next = ((head & ~ARENA_OFF_MASK) + ARENA_TAG_ONE) | first;
+	} while (!__atomic_compare_exchange_n(&c->free_head, &head, next, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static uint32_t arena_pop(struct ashmem_arena *arena, unsigned int cls)
+{
+	struct ashmem_arena_class	*c = &arena->hdr->classes[cls];
+	uint64_t			 head, next;
+	uint32_t			 off;
+
+	head = __atomic_load_n(&c->free_head, __ATOMIC_ACQUIRE);
+	do {
+		off = (uint32_t)head;
+		if (!off)
+			return 0;
+		/*
+		 * The block may be handed out by someone else right now, the
+		 * link read is then stale but the tag makes the CAS fail.
+		 */
+		next = ((head & ~ARENA_OFF_MASK) + ARENA_TAG_ONE) |
+			__atomic_load_n(arena_link(arena, off), __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&c->free_head, &head, next, 1,
+					      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return off;
+}
+
+static uint32_t arena_grab_pages(struct ashmem_arena *arena, unsigned int nr_pages, uint8_t owner)
+{
+	struct ashmem_arena_header	*hdr = arena->hdr;
+	uint32_t			 page, i;
+
+	page = __atomic_load_n(&hdr->next_page, __ATOMIC_RELAXED);
+	do {
+		if (page + nr_pages > hdr->nr_pages)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&hdr->next_page, &page, page + nr_pages, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (i = 0; i < nr_pages; i++)
+		__atomic_store_n(&hdr->page_class[page + i], owner, __ATOMIC_RELEASE);
+	arena->stats.pages += nr_pages;
+
+	return page << ARENA_PAGE_SHIFT;
+}
+
+/* carve a fresh page into blocks, fill the local cache and publish the rest */
+static int arena_carve_page(struct ashmem_arena *arena, unsigned int cls)
+{
+	struct ashmem_arena_cache	*cache = &arena->cache[cls];
+	uint32_t			 bs = arena_block_size(cls);
+	uint32_t			 page, off, end, first = 0, prev = 0;
+
+	page = arena_grab_pages(arena, 1, cls);
+	if (!page)
+		return -ENOMEM;
+
+	end = page + ARENA_PAGE_SIZE;
+	for (off = page; off < end; off += bs)
+	{
+		if (cache->count < ARENA_CACHE_SIZE / 2)
+		{
+			cache->offs[cache->count++] = off;
+			continue;
+		}
+		if (prev)
+			*arena_link(arena, prev) = off;
+		else
+			first = off;
+		prev = off;
+	}
+
+	if (first)
+		arena_push_chain(arena, cls, first, prev);
+
+	return 0;
+}
+
+static int arena_refill(struct ashmem_arena *arena, unsigned int cls)
+{
+	struct ashmem_arena_cache	*cache = &arena->cache[cls];
+	uint32_t			 off;
+
+	while (cache->count < ARENA_CACHE_SIZE / 2)
+	{
+		off = arena_pop(arena, cls);
+		if (!off)
+			break;
+		cache->offs[cache->count++] = off;
+	}
+
+	if (!cache->count && arena_carve_page(arena, cls))
+		return -ENOMEM;
+
+	arena->stats.refills++;
+	return 0;
+}
+
+/* give the oldest @count cached blocks back to the shared list */
+static void arena_flush(struct ashmem_arena *arena, unsigned int cls, unsigned int count)
+{
+	struct ashmem_arena_cache	*cache = &arena->cache[cls];
+	unsigned int			 i;
+
+	if (!count)
+		return;
+
+	for (i = 0; i + 1 < count; i++)
+		*arena_link(arena, cache->offs[i]) = cache->offs[i + 1];
+	arena_push_chain(arena, cls, cache->offs[0], cache->offs[count - 1]);
+
+	memmove(cache->offs, cache->offs + count, (cache->count - count) * sizeof(uint32_t));
+	cache->count -= count;
+	arena->stats.flushes++;
+}
+
+/* lay out an empty arena over @base, done once by the creator of the region */
+int ashmem_arena_format(void *base, size_t size)
+{
+	struct ashmem_arena_header	*hdr = base;
+	uint32_t			 nr_pages = size >> ARENA_PAGE_SHIFT;
+	uint32_t			 first;
+
+	if (size > UINT32_MAX || nr_pages <= arena_header_pages(nr_pages))
+		return -EINVAL;
+
+	first = arena_header_pages(nr_pages);
+	memset(hdr, 0, first << ARENA_PAGE_SHIFT);
+	memset(hdr->page_class, ARENA_PAGE_FREE, nr_pages);
+
+	hdr->size	= size;
+	hdr->nr_pages	= nr_pages;
+	hdr->next_page	= first;
+	__atomic_store_n(&hdr->magic, ARENA_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int ashmem_arena_attach(struct ashmem_arena *arena, void *base, size_t size)
+{
+	struct ashmem_arena_header *hdr = base;
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != ARENA_MAGIC || hdr->size > size)
+		return -EINVAL;
+
+	memset(arena, 0, sizeof(*arena));
+	arena->base = base;
+	arena->size = hdr->size;
+	arena->hdr  = hdr;
+
+	return 0;
+}
+
+/* return everything this process still caches to the shared lists */
+void ashmem_arena_detach(struct ashmem_arena *arena)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < ARENA_NR_CLASSES; cls++)
+		arena_flush(arena, cls, arena->cache[cls].count);
+}
+
+uint32_t ashmem_arena_alloc(struct ashmem_arena *arena, size_t size)
+{
+	struct ashmem_arena_cache	*cache;
+	unsigned int			 cls;
+
+	if (!size || size > ARENA_MAX_ALLOC)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+
+	cls   = arena_class_of(size);
+	cache = &arena->cache[cls];
+
+	if (!cache->count && arena_refill(arena, cls))
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+
+	arena->stats.allocs++;
+	return cache->offs[--cache->count];
+}
+
+void ashmem_arena_free(struct ashmem_arena *arena, uint32_t off)
+{
+	struct ashmem_arena_cache	*cache;
+	uint8_t				 cls;
+
+	if (!off || off >= arena->size)
+		return;
+
+	cls = __atomic_load_n(&arena->hdr->page_class[off >> ARENA_PAGE_SHIFT], __ATOMIC_ACQUIRE);
+	if (cls >= ARENA_NR_CLASSES)
+		return;
+
+	cache = &arena->cache[cls];
+	if (cache->count == ARENA_CACHE_SIZE)
+		arena_flush(arena, cls, ARENA_CACHE_SIZE / 2);
+
+	cache->offs[cache->count++] = off;
+	arena->stats.frees++;
+}
+
+uint32_t ashmem_arena_alloc_pages(struct ashmem_arena *arena, unsigned int nr_pages)
+{
+	uint32_t off;
+
+	off = nr_pages ? arena_grab_pages(arena, nr_pages, ARENA_PAGE_RUN) : 0;
+	if (!off)
+		errno = ENOMEM;
+
+	return off;
+}
+
+void ashmem_arena_set_root(struct ashmem_arena *arena, uint32_t off)
+{
+	__atomic_store_n(&arena->hdr->root, off, __ATOMIC_RELEASE);
+}
+
+uint32_t ashmem_arena_get_root(struct ashmem_arena *arena)
+{
+	return __atomic_load_n(&arena->hdr->root, __ATOMIC_ACQUIRE);
+}
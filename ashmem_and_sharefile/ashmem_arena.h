@@ -0,0 +1,81 @@
+#ifndef _ASHMEM_ARENA_H_
+#define _ASHMEM_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Slab allocator living inside a shared ashmem region.
+ *
+ * Everything stored in the region is addressed by 32 bit offsets from the
+ * start of the mapping, so the region can be mapped at a different address
+ * in every process.  Offset 0 is the arena header and doubles as NULL.
+ *
+ * Small objects come from power of two size classes.  Each class owns whole
+ * pages carved out of the region with an atomic bump pointer, and keeps its
+ * free blocks on a lock-free list in the shared header (offset + ABA tag
+ * packed into one 64 bit word).  Every process additionally keeps a small
+ * private cache per class, so most alloc/free pairs never touch shared
+ * cache lines.  A struct ashmem_arena is that private part and must not be
+ * shared between threads.
+ *
+ * Page runs from ashmem_arena_alloc_pages() are for long lived structures
+ * (queues, tables) and are never given back.
+ */
+
+#define ARENA_PAGE_SHIFT	12
+#define ARENA_PAGE_SIZE		(1U << ARENA_PAGE_SHIFT)
+#define ARENA_MIN_SHIFT		4	/* 16 bytes */
+#define ARENA_NR_CLASSES	8	/* 16 .. 2048 bytes */
+#define ARENA_MAX_ALLOC		(1U << (ARENA_MIN_SHIFT + ARENA_NR_CLASSES - 1))
+#define ARENA_CACHE_SIZE	32
+#define ARENA_CACHELINE		64
+
+struct ashmem_arena_cache
+{
+	unsigned int	count;
+	uint32_t	offs[ARENA_CACHE_SIZE];
+};
+
+struct ashmem_arena_stats
+{
+	unsigned long	allocs;
+	unsigned long	frees;
+	unsigned long	refills;	/* batches taken from the shared lists */
+	unsigned long	flushes;	/* batches given back to the shared lists */
+	unsigned long	pages;		/* pages carved by this process */
+};
+
+struct ashmem_arena_header;
+
+struct ashmem_arena
+{
+	unsigned char			*base;
+	size_t				 size;
+	struct ashmem_arena_header	*hdr;
+	struct ashmem_arena_cache	 cache[ARENA_NR_CLASSES];
+	struct ashmem_arena_stats	 stats;
+};
+
+int ashmem_arena_format(void *base, size_t size);
+int ashmem_arena_attach(struct ashmem_arena *arena, void *base, size_t size);
+void ashmem_arena_detach(struct ashmem_arena *arena);
+
+uint32_t ashmem_arena_alloc(struct ashmem_arena *arena, size_t size);
+void ashmem_arena_free(struct ashmem_arena *arena, uint32_t off);
+uint32_t ashmem_arena_alloc_pages(struct ashmem_arena *arena, unsigned int nr_pages);
+
+void ashmem_arena_set_root(struct ashmem_arena *arena, uint32_t off);
+uint32_t ashmem_arena_get_root(struct ashmem_arena *arena);
+
+static inline void *ashmem_arena_ptr(struct ashmem_arena *arena, uint32_t off)
+{
+	return off ? arena->base + off : NULL;
+}
+
+static inline uint32_t ashmem_arena_off(struct ashmem_arena *arena, const void *ptr)
+{
+	return ptr ? (uint32_t)((const unsigned char *)ptr - arena->base) : 0;
+}
+
+#endif /* _ASHMEM_ARENA_H_ */
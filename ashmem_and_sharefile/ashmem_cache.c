@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ashmem.h"
+#include "ashmem_app.h"
+#include "ashmem_cache.h"
+
+static unsigned int cache_slot_index(struct ashmem_cache *cache, unsigned long key)
+{
+	/* fibonacci hashing, keeps sequential keys apart */
+	return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) % cache->nr_slots;
+}
+
+static void *cache_slot_addr(struct ashmem_cache *cache, unsigned int idx)
+{
+	return cache->base + (size_t)idx * cache->slot_size;
+}
+
+struct ashmem_cache *ashmem_cache_create(const char *name, unsigned int nr_slots,
+					 size_t obj_size, ashmem_cache_fill_t fill,
+					 void *arg)
+{
+	struct ashmem_cache	*cache;
+	size_t			 page_size = sysconf(_SC_PAGESIZE);
+	size_t			 length;
+
+	if (!nr_slots || !obj_size || !fill)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->slots = calloc(nr_slots, sizeof(*cache->slots));
+	if (!cache->slots)
+		goto err_free_cache;
+
+	cache->nr_slots	 = nr_slots;
+	cache->slot_size = (obj_size + page_size - 1) & ~(page_size - 1);
+	cache->fill	 = fill;
+	cache->arg	 = arg;
+	length		 = cache->slot_size * nr_slots;
+
+	cache->fd = ashmem_open(name, length);
+	if (cache->fd < 0)
+		goto err_free_slots;
+
+	cache->base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if (cache->base == MAP_FAILED)
+		goto err_close;
+
+	/* nothing cached yet, the whole region is fair game for the shrinker */
+	if (ashmem_unpin_region(cache->fd, 0, length) < 0)
+		goto err_unmap;
+
+	return cache;
+
+err_unmap:
+	munmap(cache->base, length);
+err_close:
+	close(cache->fd);
+err_free_slots:
+	free(cache->slots);
+err_free_cache:
+	free(cache);
+	return NULL;
+}
+
+void ashmem_cache_destroy(struct ashmem_cache *cache)
+{
+	if (!cache)
+		return;
+
+	munmap(cache->base, cache->slot_size * cache->nr_slots);
+	close(cache->fd);
+	free(cache->slots);
+	free(cache);
+}
+
+/*
+ * Return the object for @key pinned in memory, building it if it is not
+ * cached or if the kernel purged it since the last ashmem_cache_put().
+ * Returns NULL with errno set to EBUSY when the slot is pinned for a
+ * different key.
+ */
+void *ashmem_cache_get(struct ashmem_cache *cache, unsigned long key)
+{
+	unsigned int		  idx  = cache_slot_index(cache, key);
+	struct ashmem_cache_slot *slot = &cache->slots[idx];
+	void			 *addr = cache_slot_addr(cache, idx);
+	int			  ret;
+
+	cache->stats.lookups++;
+
+	if (slot->pin_count)
+	{
+		/* already pinned, so it cannot have been purged */
+		if (slot->valid && slot->key == key)
+		{
+			slot->pin_count++;
+			cache->stats.hits++;
+			return addr;
+		}
+		cache->stats.busy++;
+		errno = EBUSY;
+		return NULL;
+	}
+
+	ret = ashmem_pin_region(cache->fd, (char *)addr - (char *)cache->base, cache->slot_size);
+	if (ret < 0)
+		return NULL;
+
+	if (slot->valid && slot->key == key)
+	{
+		if (ret != ASHMEM_WAS_PURGED)
+		{
+			slot->pin_count = 1;
+			cache->stats.hits++;
+			return addr;
+		}
+		cache->stats.purges++;
+	}
+	else
+	{
+		cache->stats.misses++;
+	}
+
+	slot->valid = 0;
+	if (cache->fill(key, addr, cache->slot_size, cache->arg))
+	{
+		ashmem_unpin_region(cache->fd, (char *)addr - (char *)cache->base, cache->slot_size);
+		errno = EIO;
+		return NULL;
+	}
+
+	slot->key	= key;
+	slot->valid	= 1;
+	slot->pin_count = 1;
+
+	return addr;
+}
+
+/* drop a reference taken by ashmem_cache_get(), the last one unpins the slot */
+void ashmem_cache_put(struct ashmem_cache *cache, unsigned long key)
+{
+	unsigned int		  idx  = cache_slot_index(cache, key);
+	struct ashmem_cache_slot *slot = &cache->slots[idx];
+
+	if (!slot->pin_count || !slot->valid || slot->key != key)
+		return;
+
+	if (--slot->pin_count == 0)
+		ashmem_unpin_region(cache->fd, (size_t)idx * cache->slot_size, cache->slot_size);
+}
+
+void ashmem_cache_get_stats(struct ashmem_cache *cache, struct ashmem_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
+
+static double cache_rate(unsigned long count, unsigned long total)
+{
+	return total ? 100.0 * count / total : 0.0;
+}
+
+void ashmem_cache_print_stats(struct ashmem_cache *cache)
+{
+	struct ashmem_cache_stats *s = &cache->stats;
+
+	printf("cache: lookups=%lu hit=%lu (%.1f%%) miss=%lu (%.1f%%) purged=%lu (%.1f%%) busy=%lu\n",
+	       s->lookups,
+	       s->hits, cache_rate(s->hits, s->lookups),
+	       s->misses, cache_rate(s->misses, s->lookups),
+	       s->purges, cache_rate(s->purges, s->lookups),
+	       s->busy);
+}
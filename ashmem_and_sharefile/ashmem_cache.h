@@ -0,0 +1,59 @@
+#ifndef _ASHMEM_CACHE_H_
+#define _ASHMEM_CACHE_H_
+
+#include <stddef.h>
+
+/*
+ * Purgeable object cache on top of one ashmem region.
+ *
+ * The region is cut into page aligned slots, one object per slot.  A slot
+ * is pinned only between ashmem_cache_get() and ashmem_cache_put(); the
+ * rest of the time it is unpinned, so the ashmem shrinker is free to drop
+ * it under memory pressure.  When a pin reports ASHMEM_WAS_PURGED the
+ * object is rebuilt through the fill callback, the caller never sees a
+ * purged object.
+ */
+
+/* build the object for @key into @buf (at most @size bytes), return 0 on success */
+typedef int (*ashmem_cache_fill_t)(unsigned long key, void *buf, size_t size, void *arg);
+
+struct ashmem_cache_stats
+{
+	unsigned long	lookups;
+	unsigned long	hits;
+	unsigned long	misses;		/* key not cached, slot (re)filled */
+	unsigned long	purges;		/* key cached but purged by the kernel */
+	unsigned long	busy;		/* slot pinned for another key */
+};
+
+struct ashmem_cache_slot
+{
+	unsigned long	key;
+	unsigned int	pin_count;
+	int		valid;
+};
+
+struct ashmem_cache
+{
+	int				 fd;
+	unsigned char			*base;
+	size_t				 slot_size;
+	unsigned int			 nr_slots;
+	ashmem_cache_fill_t		 fill;
+	void				*arg;
+	struct ashmem_cache_slot	*slots;
+	struct ashmem_cache_stats	 stats;
+};
+
+struct ashmem_cache *ashmem_cache_create(const char *name, unsigned int nr_slots,
+					 size_t obj_size, ashmem_cache_fill_t fill,
+					 void *arg);
+void ashmem_cache_destroy(struct ashmem_cache *cache);
+
+void *ashmem_cache_get(struct ashmem_cache *cache, unsigned long key);
+void ashmem_cache_put(struct ashmem_cache *cache, unsigned long key);
+
+void ashmem_cache_get_stats(struct ashmem_cache *cache, struct ashmem_cache_stats *stats);
+void ashmem_cache_print_stats(struct ashmem_cache *cache);
+
+#endif /* _ASHMEM_CACHE_H_ */
@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ashmem_queue.h"
+
+#define QUEUE_MAGIC		0x71756575	/* "queu" */
+#define QUEUE_SPIN		256
+
+struct queue_slot
+{
+	uint64_t	seq;
+	uint32_t	len;
+	uint32_t	pad;
+	unsigned char	data[];
+};
+
+static struct queue_slot *queue_slot(struct ashmem_queue *q, uint64_t pos)
+{
+	return (struct queue_slot *)(q->slots + (size_t)(pos & (q->nr_slots - 1)) * q->slot_size);
+}
+
+static uint32_t queue_slot_size(size_t msg_size)
+{
+	size_t size = sizeof(struct queue_slot) + msg_size;
+
+	return (size + ASHMEM_QUEUE_CACHELINE - 1) & ~(size_t)(ASHMEM_QUEUE_CACHELINE - 1);
+}
+
+static long queue_futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
+
+static int64_t queue_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t ashmem_queue_bytes(unsigned int nr_slots, size_t msg_size)
+{
+	return sizeof(struct ashmem_queue) + (size_t)nr_slots * queue_slot_size(msg_size);
+}
+
+int ashmem_queue_init(struct ashmem_queue *q, unsigned int nr_slots, size_t msg_size)
+{
+	unsigned int i;
+
+	/* with a single slot "free" and "ready" would share a sequence number */
+	if (nr_slots < 2 || (nr_slots & (nr_slots - 1)) || !msg_size || msg_size > UINT32_MAX)
+		return -EINVAL;
+
+	memset(q, 0, sizeof(*q));
+	q->nr_slots  = nr_slots;
+	q->msg_size  = msg_size;
+	q->slot_size = queue_slot_size(msg_size);
+
+	for (i = 0; i < nr_slots; i++)
+		queue_slot(q, i)->seq = i;
+
+	__atomic_store_n(&q->magic, QUEUE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int ashmem_queue_check(struct ashmem_queue *q)
+{
+	return __atomic_load_n(&q->magic, __ATOMIC_ACQUIRE) == QUEUE_MAGIC ? 0 : -EINVAL;
+}
+
+static void queue_wake(struct ashmem_queue *q)
+{
+	/* pairs with the fence in queue_wait(), either we see it asleep or it sees our slots */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&q->futex, 1, __ATOMIC_RELEASE);
+	queue_futex(&q->futex, FUTEX_WAKE, 1, NULL);
+}
+
+unsigned int ashmem_queue_send_batch(struct ashmem_queue *q, const void *msgs,
+				     uint32_t len, unsigned int n)
+{
+	const unsigned char	*src = msgs;
+	uint64_t		 pos, seq;
+	unsigned int		 i, k;
+
+	if (len > q->msg_size)
+	{
+		errno = EMSGSIZE;
+		return 0;
+	}
+	if (n > q->nr_slots)
+		n = q->nr_slots;
+	if (!n)
+		return 0;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&queue_slot(q, pos)->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos)
+		{
+			if ((int64_t)(seq - pos) < 0)
+			{
+				/* consumer has not released this slot yet: full */
+				errno = EAGAIN;
+				return 0;
+			}
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* the consumer frees slots in order, the last free one bounds the batch */
+		for (k = n; k > 1; k--)
+			if (__atomic_load_n(&queue_slot(q, pos + k - 1)->seq,
+					    __ATOMIC_ACQUIRE) == pos + k - 1)
+				break;
+
+		if (__atomic_compare_exchange_n(&q->tail, &pos, pos + k, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	for (i = 0; i < k; i++)
+	{
+		struct queue_slot *slot = queue_slot(q, pos + i);
+
+		memcpy(slot->data, src + (size_t)i * len, len);
+		slot->len = len;
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	queue_wake(q);
+	return k;
+}
+
+int ashmem_queue_send(struct ashmem_queue *q, const void *msg, uint32_t len)
+{
+	return ashmem_queue_send_batch(q, msg, len, 1) ? 0 : -1;
+}
+
+static int queue_ready(struct ashmem_queue *q, uint64_t pos)
+{
+	return __atomic_load_n(&queue_slot(q, pos)->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* wait until the slot at @pos is published, 0 on success, -ETIMEDOUT or -ESHUTDOWN */
+static int queue_wait(struct ashmem_queue *q, uint64_t pos, int timeout_ms)
+{
+	int64_t		deadline = 0, left;
+	struct timespec	ts, *tsp;
+	uint32_t	val;
+	int		i;
+
+	for (i = 0; i < QUEUE_SPIN; i++)
+		if (queue_ready(q, pos))
+			return 0;
+
+	if (timeout_ms > 0)
+		deadline = queue_now_ns() + (int64_t)timeout_ms * 1000000;
+
+	for (;;)
+	{
+		val = __atomic_load_n(&q->futex, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (queue_ready(q, pos) || __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			break;
+
+		tsp = NULL;
+		if (timeout_ms > 0)
+		{
+			left = deadline - queue_now_ns();
+			if (left <= 0)
+				break;
+			ts.tv_sec  = left / 1000000000;
+			ts.tv_nsec = left % 1000000000;
+			tsp = &ts;
+		}
+		queue_futex(&q->futex, FUTEX_WAIT, val, tsp);
+	}
+
+	__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+	if (queue_ready(q, pos))
+		return 0;
+
+	return __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) ? -ESHUTDOWN : -ETIMEDOUT;
+}
+
+unsigned int ashmem_queue_recv_batch(struct ashmem_queue *q, void *msgs, uint32_t *lens,
+				     unsigned int max, int timeout_ms)
+{
+	unsigned char	*dst = msgs;
+	uint64_t	 pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned int	 n;
+	int		 ret;
+
+	if (!max)
+		return 0;
+
+	if (!queue_ready(q, pos))
+	{
+		ret = timeout_ms ? queue_wait(q, pos, timeout_ms) : -EAGAIN;
+		if (ret)
+		{
+			errno = -ret;
+			return 0;
+		}
+	}
+
+	for (n = 0; n < max && queue_ready(q, pos); n++, pos++)
+	{
+		struct queue_slot *slot = queue_slot(q, pos);
+
+		memcpy(dst + (size_t)n * q->msg_size, slot->data, slot->len);
+		if (lens)
+			lens[n] = slot->len;
+		__atomic_store_n(&slot->seq, pos + q->nr_slots, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&q->head, pos, __ATOMIC_RELAXED);
+	return n;
+}
+
+int ashmem_queue_recv(struct ashmem_queue *q, void *msg, int timeout_ms)
+{
+	uint32_t len;
+
+	if (!ashmem_queue_recv_batch(q, msg, &len, 1, timeout_ms))
+		return -1;
+
+	return len;
+}
+
+int ashmem_queue_wait(struct ashmem_queue *q, int timeout_ms)
+{
+	uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	if (queue_ready(q, pos))
+		return 0;
+	if (!timeout_ms)
+		return -EAGAIN;
+
+	return queue_wait(q, pos, timeout_ms);
+}
+
+void ashmem_queue_close(struct ashmem_queue *q)
+{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+	/* the consumer may sit in the futex right now, make its wait fail */
+	__atomic_add_fetch(&q->futex, 1, __ATOMIC_RELEASE);
+	queue_futex(&q->futex, FUTEX_WAKE, INT32_MAX, NULL);
+}
@@ -0,0 +1,74 @@
+#ifndef _ASHMEM_QUEUE_H_
+#define _ASHMEM_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer/single-consumer message queue in shared memory.
+ *
+ * The queue is a ring of fixed size slots, each with a sequence number
+ * telling whether it is free, being written or ready (Vyukov style), so
+ * producers only contend on the tail index and never on the consumer.
+ * The producer and consumer indices sit on their own cache lines.
+ *
+ * Producers may claim and fill several slots with one CAS and wake the
+ * consumer once per batch.  An idle consumer sleeps on a futex in the
+ * shared header (no FUTEX_PRIVATE_FLAG, the waker lives in another
+ * process), producers only issue the wake syscall when it is asleep.
+ *
+ * The structure contains no pointers and may be placed anywhere in a
+ * mapping shared by several processes, e.g. with ashmem_arena_alloc_pages().
+ */
+
+#define ASHMEM_QUEUE_CACHELINE	64
+
+struct ashmem_queue
+{
+	uint32_t	magic;
+	uint32_t	nr_slots;	/* power of two, at least 2 */
+	uint32_t	msg_size;
+	uint32_t	slot_size;
+
+	/* producers */
+	uint64_t	tail __attribute__((aligned(ASHMEM_QUEUE_CACHELINE)));
+
+	/* consumer */
+	uint64_t	head __attribute__((aligned(ASHMEM_QUEUE_CACHELINE)));
+
+	/* consumer sleep/wake */
+	uint32_t	futex __attribute__((aligned(ASHMEM_QUEUE_CACHELINE)));
+	uint32_t	sleeping;
+	uint32_t	closed;		/* set once by ashmem_queue_close() */
+
+	unsigned char	slots[] __attribute__((aligned(ASHMEM_QUEUE_CACHELINE)));
+};
+
+size_t ashmem_queue_bytes(unsigned int nr_slots, size_t msg_size);
+int ashmem_queue_init(struct ashmem_queue *q, unsigned int nr_slots, size_t msg_size);
+int ashmem_queue_check(struct ashmem_queue *q);
+
+/* copy @n messages of @len bytes each from @msgs, returns how many fit */
+unsigned int ashmem_queue_send_batch(struct ashmem_queue *q, const void *msgs,
+				     uint32_t len, unsigned int n);
+int ashmem_queue_send(struct ashmem_queue *q, const void *msg, uint32_t len);
+
+/*
+ * Receive up to @max messages into @msgs (msg_size bytes apart) and their
+ * lengths into @lens.  Waits up to @timeout_ms for the first one (-1 means
+ * forever, 0 polls), returns the number received.
+ */
+unsigned int ashmem_queue_recv_batch(struct ashmem_queue *q, void *msgs, uint32_t *lens,
+				     unsigned int max, int timeout_ms);
+int ashmem_queue_recv(struct ashmem_queue *q, void *msg, int timeout_ms);
+
+/* wait up to @timeout_ms for a message without consuming it, 0 when one is ready */
+int ashmem_queue_wait(struct ashmem_queue *q, int timeout_ms);
+
+/*
+ * Wake the consumer for good: waits return -ESHUTDOWN (recv sets errno)
+ * instead of sleeping, messages already queued can still be received.
+ */
+void ashmem_queue_close(struct ashmem_queue *q);
+
+#endif /* _ASHMEM_QUEUE_H_ */
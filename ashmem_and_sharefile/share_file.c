@@ -7,6 +7,7 @@
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/namei.h>
 #include <linux/nsproxy.h>
 #include <linux/poll.h>
 #include <linux/debugfs.h>
@@ -16,23 +17,69 @@
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
+#include <linux/kref.h>
 
 #include "share_file.h"
+#include "ashmem.h"
 
+#define ASHMEM_DEVICE	"/dev/ashmem"
+
+/*
+ * One open of /dev/shfile.  Nothing here refers to the opener's files: a
+ * publisher that exits without closing its handle drops the last reference
+ * to it with its fd table, and that is what unpublishes.
+ */
 struct shfile_proc
 {
 	int pid;
-	struct task_struct *tsk;
-	struct files_struct *files;
+	struct list_head refs;		/* shfile_ref: entries this process fetched */
 };
 
-struct shfile_file
+/*
+ * A published file.  The entry owns one reference on the file for as long
+ * as it is listed; it is unlisted and that reference dropped when the
+ * publisher closes its shfile handle.  The kref only keeps the entry
+ * itself alive for clients still holding a shfile_ref to it.
+ */
+struct shfile_entry
 {
-	int fd;
+	struct list_head node;
+	struct kref ref;
 	struct file *fp;
+	struct shfile_proc *owner;
+	int owner_pid;
+	int fd;
+	bool ashmem;
+	loff_t size;			/* when published */
+	unsigned long id;
+	int clients;			/* client processes holding a shfile_ref */
+	unsigned long handed_out;	/* fds installed into clients */
 };
 
-struct shfile_file shfile;
+struct shfile_ref
+{
+	struct list_head node;
+	struct shfile_entry *entry;
+};
+
+static LIST_HEAD(shfile_entries);	/* newest first */
+static DEFINE_MUTEX(shfile_lock);
+static unsigned long shfile_next_id;
+static struct dentry *shfile_debugfs;
+
+static void shfile_entry_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct shfile_entry, ref));
+}
+
+static void shfile_unpublish(struct shfile_entry *entry)
+{
+	list_del_init(&entry->node);
+	fput(entry->fp);
+	entry->fp = NULL;
+	entry->owner = NULL;
+	kref_put(&entry->ref, shfile_entry_free);
+}
 
 static int shfile_open(struct inode *inode, struct file *file)
 {
@@ -41,9 +88,8 @@ static int shfile_open(struct inode *inode, struct file *file)
 	proc = kzalloc(sizeof(*proc), GFP_KERNEL);
 	if (proc == NULL)
 		return -ENOMEM;
-	proc->tsk = current;
 	proc->pid = current->group_leader->pid;
-	proc->files = get_files_struct(proc->tsk);
+	INIT_LIST_HEAD(&proc->refs);
 	file->private_data = proc;
 	
 	return 0;
@@ -52,89 +98,55 @@ static int shfile_open(struct inode *inode, struct file *file)
 static int shfile_release(struct inode *inode, struct file *file)
 {
 	struct shfile_proc *proc = file->private_data;
+	struct shfile_entry *entry, *tmp;
+	struct shfile_ref *ref, *rtmp;
+
+	mutex_lock(&shfile_lock);
+
+	/* everything this process published goes away with it */
+	list_for_each_entry_safe(entry, tmp, &shfile_entries, node)
+		if (entry->owner == proc)
+			shfile_unpublish(entry);
+
+	list_for_each_entry_safe(ref, rtmp, &proc->refs, node) {
+		ref->entry->clients--;
+		kref_put(&ref->entry->ref, shfile_entry_free);
+		list_del(&ref->node);
+		kfree(ref);
+	}
+
+	mutex_unlock(&shfile_lock);
 
 	kfree(proc);
 	return 0;
 }
 
-static int task_get_unused_fd_flags(struct shfile_proc *proc, int flags)
+/* whether @fp is an open of the ashmem misc device */
+static bool shfile_is_ashmem(struct file *fp)
 {
-	struct files_struct *files = proc->files;
-	int fd, error;
-	struct fdtable *fdt;
-	unsigned long rlim_cur;
-	unsigned long irqs;
-
-	if (files == NULL)
-		return -ESRCH;
-
-	error = -EMFILE;
-	spin_lock(&files->file_lock);
-
-repeat:
-	fdt = files_fdtable(files);
-	fd = find_next_zero_bit(fdt->open_fds, fdt->max_fds, files->next_fd);
-
-	/*
-	 * N.B. For clone tasks sharing a files structure, this test
-	 * will limit the total number of files that can be opened.
-	 */
-	rlim_cur = 0;
-	if (lock_task_sighand(proc->tsk, &irqs)) {
-		rlim_cur = proc->tsk->signal->rlim[RLIMIT_NOFILE].rlim_cur;
-		unlock_task_sighand(proc->tsk, &irqs);
-	}
-	if (fd >= rlim_cur)
-		goto out;
-
-	/* Do we need to expand the fd array or fd set?  */
-	error = expand_files(files, fd);
-	if (error < 0)
-		goto out;
-
-	if (error) {
-		/*
-		 * If we needed to expand the fs array we
-		 * might have blocked - try again.
-		 */
-		error = -EMFILE;
-		goto repeat;
-	}
+	struct inode *inode = file_inode(fp);
+	struct path path;
+	bool ret;
 
-	__set_open_fd(fd, fdt);
-	if (flags & O_CLOEXEC)
-		__set_close_on_exec(fd, fdt);
-	else
-		__clear_close_on_exec(fd, fdt);
-	files->next_fd = fd + 1;
-#if 1
-	/* Sanity check */
-	if (fdt->fd[fd] != NULL) {
-		printk(KERN_WARNING "get_unused_fd: slot %d not NULL!\n", fd);
-		fdt->fd[fd] = NULL;
-	}
-#endif
-	error = fd;
+	if (!S_ISCHR(inode->i_mode) || imajor(inode) != MISC_MAJOR)
+		return false;
+	if (kern_path(ASHMEM_DEVICE, LOOKUP_FOLLOW, &path))
+		return false;
+	ret = d_inode(path.dentry)->i_rdev == inode->i_rdev;
+	path_put(&path);
 
-out:
-	spin_unlock(&files->file_lock);
-	return error;
+	return ret;
 }
 
-static void task_fd_install(
-	struct shfile_proc *proc, unsigned int fd, struct file *file)
+static loff_t shfile_file_size(struct file *fp, bool ashmem)
 {
-	struct files_struct *files = proc->files;
-	struct fdtable *fdt;
+	loff_t size = i_size_read(file_inode(fp));
 
-	if (files == NULL)
-		return;
+	/* an ashmem fd is the misc device node, its size lives in the area */
+	if (ashmem)
+		size = fp->f_op->unlocked_ioctl(fp, ASHMEM_GET_SIZE, 0);
 
-	spin_lock(&files->file_lock);
-	fdt = files_fdtable(files);
-	BUG_ON(fdt->fd[fd] != NULL);
-	rcu_assign_pointer(fdt->fd[fd], file);
-	spin_unlock(&files->file_lock);
+	return size < 0 ? 0 : size;
 }
 
 static long shfile_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -150,6 +162,7 @@ static long shfile_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	{
 		int fd;
 		struct file *file;
+		struct shfile_entry *entry;
 
 		if (size != sizeof(int))
 		{
@@ -162,41 +175,108 @@ static long shfile_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			goto err;
 		}
 		
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (entry == NULL)
+		{
+			ret = -ENOMEM;
+			goto err;
+		}
+
 		file = fget(fd);
 		if (file == NULL)
 		{
 			printk(KERN_ERR "shfile: invalid fd, %d\n", fd);
+			kfree(entry);
 			ret = -EINVAL;
 			goto err;
 		}
 		
-		shfile.fd = fd;
-		shfile.fp = file;
+		kref_init(&entry->ref);
+		entry->fp = file;
+		entry->fd = fd;
+		entry->ashmem = shfile_is_ashmem(file);
+		entry->size = shfile_file_size(file, entry->ashmem);
+		entry->owner = proc;
+		entry->owner_pid = proc->pid;
+
+		mutex_lock(&shfile_lock);
+		entry->id = ++shfile_next_id;
+		list_add(&entry->node, &shfile_entries);
+		mutex_unlock(&shfile_lock);
 		break;
 	}
 	case SHFILE_GET_FD:
 	{
 		int target_fd;
 		struct file *file;
+		struct shfile_entry *entry;
+		struct shfile_ref *ref, *r;
 
 		if (size != sizeof(int))
 		{
 			ret = -EINVAL;
 			goto err;
 		}
-		target_fd = task_get_unused_fd_flags(proc, O_CLOEXEC);
+
+		ref = kzalloc(sizeof(*ref), GFP_KERNEL);
+		if (ref == NULL)
+		{
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		mutex_lock(&shfile_lock);
+		entry = list_first_entry_or_null(&shfile_entries, struct shfile_entry, node);
+		if (entry == NULL)
+		{
+			mutex_unlock(&shfile_lock);
+			kfree(ref);
+			ret = -ENOENT;
+			goto err;
+		}
+
+		target_fd = get_unused_fd_flags(O_CLOEXEC);
 		if (target_fd < 0) {
-			ret = -EFAULT;
+			mutex_unlock(&shfile_lock);
+			kfree(ref);
+			ret = target_fd;
 			goto err;
 		}
-		file = shfile.fp;
-		task_fd_install(proc, target_fd, file);
-			
+		/* the fd to be installed owns its own reference */
+		file = get_file(entry->fp);
+		kref_get(&entry->ref);
+		mutex_unlock(&shfile_lock);
+
+		/* nothing can be undone once the fd is visible to the client */
 		if (copy_to_user(ubuf, &target_fd, size))
 		{
+			put_unused_fd(target_fd);
+			fput(file);
+			kref_put(&entry->ref, shfile_entry_free);
+			kfree(ref);
 			ret = -EFAULT;
 			goto err;
 		}
+		fd_install(target_fd, file);
+
+		mutex_lock(&shfile_lock);
+		entry->handed_out++;
+
+		/* one client reference per process and entry */
+		list_for_each_entry(r, &proc->refs, node)
+			if (r->entry == entry)
+				break;
+		if (&r->node == &proc->refs) {
+			/* the reference taken above moves to the client */
+			entry->clients++;
+			ref->entry = entry;
+			list_add(&ref->node, &proc->refs);
+			ref = NULL;
+		} else {
+			kref_put(&entry->ref, shfile_entry_free);
+		}
+		mutex_unlock(&shfile_lock);
+		kfree(ref);
 		break;
 	}
 	default:
@@ -211,6 +291,47 @@ err:
 }
 
 
+static int shfile_entries_show(struct seq_file *m, void *unused)
+{
+	struct shfile_entry *entry;
+	unsigned long count = 0;
+	loff_t total = 0;
+
+	seq_printf(m, "%-6s %-8s %-4s %-6s %-12s %-7s %-10s %-5s %s\n",
+		   "id", "owner", "fd", "type", "size", "clients", "handed_out",
+		   "refs", "path");
+
+	mutex_lock(&shfile_lock);
+	list_for_each_entry(entry, &shfile_entries, node) {
+		seq_printf(m, "%-6lu %-8d %-4d %-6s %-12lld %-7d %-10lu %-5ld ",
+			   entry->id, entry->owner_pid, entry->fd,
+			   entry->ashmem ? "ashmem" : "file", (long long)entry->size,
+			   entry->clients, entry->handed_out,
+			   (long)file_count(entry->fp));
+		seq_path(m, &entry->fp->f_path, "\n");
+		seq_putc(m, '\n');
+		total += entry->size;
+		count++;
+	}
+	mutex_unlock(&shfile_lock);
+
+	seq_printf(m, "%lu entries, %lld bytes\n", count, (long long)total);
+	return 0;
+}
+
+static int shfile_entries_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, shfile_entries_show, inode->i_private);
+}
+
+static const struct file_operations shfile_entries_fops = {
+	.owner = THIS_MODULE,
+	.open = shfile_entries_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static const struct file_operations shfile_fops = {
 	.owner = THIS_MODULE,
 	.open = shfile_open,
@@ -233,8 +354,14 @@ static int __init shfile_init(void)
 	if (unlikely(ret))
 	{
 		printk(KERN_ERR "shfile: failed to register misc device!\n");
+		return ret;
 	}
 
+	shfile_debugfs = debugfs_create_dir("shfile", NULL);
+	if (!IS_ERR_OR_NULL(shfile_debugfs))
+		debugfs_create_file("entries", S_IRUGO, shfile_debugfs, NULL,
+				    &shfile_entries_fops);
+
 	printk(KERN_INFO "shfile: initialized\n");
 
 	return ret;
@@ -244,6 +371,8 @@ static void __exit shfile_exit(void)
 {
 	int ret;
 	
+	debugfs_remove_recursive(shfile_debugfs);
+
 	ret = misc_deregister(&shfile_misc);
 	if (unlikely(ret))
 		printk(KERN_ERR "shfile: failed to unregister misc device!\n");
@@ -0,0 +1,446 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+/*
+ * Scheduling to execution latency of the deferral mechanisms.
+ *
+ * An hrtimer fires at the requested rate on one CPU and, like an
+ * interrupt handler would, defers a job through the mechanism under
+ * test, stamping the time.  The job records how long it waited in a
+ * log2 histogram.  While a job is still pending further ticks only count
+ * as coalesced, as they would for a real device.
+ *
+ *	echo "<mechanism> <rate hz> <ms>" > /sys/kernel/debug/deferral_bench/run
+ *	cat /sys/kernel/debug/deferral_bench/stats
+ *
+ * The write returns when the run is over.  Mechanisms: tasklet, bh_wq
+ * (v6.9+), system_wq, highpri_wq, kthread (per CPU, SCHED_NORMAL) and
+ * threaded_irq (irq_work raising a software irq whose handler wakes its
+ * irq thread).
+ */
+
+#define HIST_BUCKETS	32	/* log2 ns */
+#define MAX_RATE	1000000
+
+enum {
+	MECH_TASKLET,
+	MECH_BH_WQ,
+	MECH_SYSTEM_WQ,
+	MECH_HIGHPRI_WQ,
+	MECH_KTHREAD,
+	MECH_THREADED_IRQ,
+	MECH_MAX,
+};
+
+static const char * const mech_names[MECH_MAX] = {
+	[MECH_TASKLET]		= "tasklet",
+	[MECH_BH_WQ]		= "bh_wq",
+	[MECH_SYSTEM_WQ]	= "system_wq",
+	[MECH_HIGHPRI_WQ]	= "highpri_wq",
+	[MECH_KTHREAD]		= "kthread",
+	[MECH_THREADED_IRQ]	= "threaded_irq",
+};
+
+struct bench_stats {
+	unsigned long hist[HIST_BUCKETS];
+	unsigned long triggers;
+	unsigned long executed;
+	unsigned long coalesced;	/* ticks that found the job still pending */
+	unsigned int rate;
+	u64 sum_ns;
+	u64 max_ns;
+	u64 run_ns;
+};
+
+static struct bench {
+	struct mutex run_lock;
+	struct hrtimer timer;
+	ktime_t period;
+	int mech;
+	atomic_t pending;
+	ktime_t stamp;
+
+	struct tasklet_struct tasklet;
+	struct work_struct work;
+	struct workqueue_struct *highpri_wq;
+	struct irq_work irq_work;
+	int irq;
+
+	struct bench_stats stats[MECH_MAX];
+	struct dentry *debugfs;
+} bench;
+
+static DEFINE_PER_CPU(struct task_struct *, bench_thread);
+static DEFINE_PER_CPU(bool, bench_kick);
+
+/* the deferred job, whatever ran it */
+static void bench_done(void)
+{
+	struct bench_stats *s = &bench.stats[bench.mech];
+	u64 lat = ktime_to_ns(ktime_sub(ktime_get(), bench.stamp));
+	unsigned int b = lat ? ilog2(lat) : 0;
+
+	s->hist[min_t(unsigned int, b, HIST_BUCKETS - 1)]++;
+	s->sum_ns += lat;
+	if (lat > s->max_ns)
+		s->max_ns = lat;
+	s->executed++;
+
+	/* the stamp is read, the next tick may overwrite it */
+	atomic_set_release(&bench.pending, 0);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+static void bench_tasklet(struct tasklet_struct *t)
+{
+	bench_done();
+}
+#else
+static void bench_tasklet(unsigned long data)
+{
+	bench_done();
+}
+#endif
+
+static void bench_work(struct work_struct *work)
+{
+	bench_done();
+}
+
+static int bench_thread_fn(void *data)
+{
+	bool *kick = per_cpu_ptr(&bench_kick, (long)data);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (!xchg(kick, false)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		bench_done();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static irqreturn_t bench_irq(int irq, void *dev_id)
+{
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t bench_irq_thread(int irq, void *dev_id)
+{
+	bench_done();
+	return IRQ_HANDLED;
+}
+
+/* hard irq context, like the interrupt of a device */
+static void bench_irq_work(struct irq_work *work)
+{
+	generic_handle_irq(bench.irq);
+}
+
+static void bench_trigger(void)
+{
+	switch (bench.mech) {
+	case MECH_TASKLET:
+		tasklet_schedule(&bench.tasklet);
+		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	case MECH_BH_WQ:
+		queue_work(system_bh_wq, &bench.work);
+		break;
+#endif
+	case MECH_SYSTEM_WQ:
+		queue_work(system_wq, &bench.work);
+		break;
+	case MECH_HIGHPRI_WQ:
+		queue_work(bench.highpri_wq, &bench.work);
+		break;
+	case MECH_KTHREAD:
+		/* CPUs that came online after loading have no thread */
+		if (!this_cpu_read(bench_thread)) {
+			atomic_set(&bench.pending, 0);
+			break;
+		}
+		this_cpu_write(bench_kick, true);
+		wake_up_process(this_cpu_read(bench_thread));
+		break;
+	case MECH_THREADED_IRQ:
+		irq_work_queue(&bench.irq_work);
+		break;
+	}
+}
+
+static enum hrtimer_restart bench_tick(struct hrtimer *timer)
+{
+	struct bench_stats *s = &bench.stats[bench.mech];
+
+	if (atomic_xchg(&bench.pending, 1)) {
+		s->coalesced++;
+	} else {
+		bench.stamp = ktime_get();
+		s->triggers++;
+		bench_trigger();
+	}
+
+	hrtimer_forward_now(timer, bench.period);
+	return HRTIMER_RESTART;
+}
+
+/* wait out a job left over from an earlier run, the timer is stopped */
+static void bench_sync(void)
+{
+	int cpu;
+
+	irq_work_sync(&bench.irq_work);
+	synchronize_irq(bench.irq);
+	tasklet_kill(&bench.tasklet);
+	cancel_work_sync(&bench.work);
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(per_cpu(bench_kick, cpu), false);
+}
+
+static int bench_run(int mech, unsigned int rate, unsigned int ms)
+{
+	struct bench_stats *s = &bench.stats[mech];
+	ktime_t start;
+	int i;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+	if (mech == MECH_BH_WQ)
+		return -EOPNOTSUPP;
+#endif
+	if (!rate || rate > MAX_RATE || !ms)
+		return -EINVAL;
+
+	/* a job that timed out last time must not clear this run's pending */
+	bench_sync();
+	atomic_set(&bench.pending, 0);
+
+	memset(s, 0, sizeof(*s));
+	s->rate = rate;
+	bench.mech = mech;
+	bench.period = ns_to_ktime(NSEC_PER_SEC / rate);
+
+	start = ktime_get();
+	hrtimer_start(&bench.timer, bench.period, HRTIMER_MODE_REL_PINNED);
+	msleep(ms);
+	hrtimer_cancel(&bench.timer);
+
+	/* let the last job finish, every mechanism gets to it eventually */
+	for (i = 0; atomic_read(&bench.pending) && i < 1000; i++)
+		msleep(1);
+	s->run_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return atomic_read(&bench.pending) ? -ETIMEDOUT : 0;
+}
+
+static ssize_t run_write(struct file *file, const char __user *ubuf,
+			 size_t count, loff_t *ppos)
+{
+	char buf[64], name[24];
+	unsigned int rate, ms;
+	int mech, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%23s %u %u", name, &rate, &ms) != 3)
+		return -EINVAL;
+
+	mech = match_string(mech_names, MECH_MAX, name);
+	if (mech < 0)
+		return mech;
+
+	mutex_lock(&bench.run_lock);
+	ret = bench_run(mech, rate, ms);
+	mutex_unlock(&bench.run_lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations run_fops = {
+	.owner = THIS_MODULE,
+	.write = run_write,
+};
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct bench_stats *s;
+	int mech, i;
+
+	mutex_lock(&bench.run_lock);
+	for (mech = 0; mech < MECH_MAX; mech++) {
+		s = &bench.stats[mech];
+		if (!s->run_ns)
+			continue;
+
+		seq_printf(m, "%s: rate %u/s triggers %lu executed %lu (%llu/s) coalesced %lu\n",
+			   mech_names[mech], s->rate, s->triggers, s->executed,
+			   div64_u64((u64)s->executed * NSEC_PER_SEC, s->run_ns),
+			   s->coalesced);
+		seq_printf(m, "  latency avg %llu ns max %llu ns\n",
+			   s->executed ? div64_u64(s->sum_ns, s->executed) : 0,
+			   s->max_ns);
+		for (i = 0; i < HIST_BUCKETS; i++)
+			if (s->hist[i])
+				seq_printf(m, "  %10llu - %10llu ns: %lu\n",
+					   i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1,
+					   s->hist[i]);
+	}
+	mutex_unlock(&bench.run_lock);
+
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void bench_stop_threads(void)
+{
+	struct task_struct *t;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		t = per_cpu(bench_thread, cpu);
+		if (t)
+			kthread_stop(t);
+		per_cpu(bench_thread, cpu) = NULL;
+	}
+}
+
+/* one thread per CPU, so a wakeup never leaves the CPU of the timer */
+static int bench_start_threads(void)
+{
+	struct task_struct *t;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		t = kthread_create_on_node(bench_thread_fn, (void *)(long)cpu,
+					   cpu_to_node(cpu), "deferral_bench/%d", cpu);
+		if (IS_ERR(t)) {
+			bench_stop_threads();
+			return PTR_ERR(t);
+		}
+		kthread_bind(t, cpu);
+		per_cpu(bench_thread, cpu) = t;
+		wake_up_process(t);
+	}
+
+	return 0;
+}
+
+/* a software irq nobody else knows about, raised from irq_work */
+static int bench_setup_irq(void)
+{
+	int ret;
+
+	bench.irq = irq_alloc_desc(NUMA_NO_NODE);
+	if (bench.irq < 0)
+		return bench.irq;
+
+	irq_set_chip_and_handler(bench.irq, &dummy_irq_chip, handle_simple_irq);
+	irq_clear_status_flags(bench.irq, IRQ_NOREQUEST | IRQ_NOPROBE);
+
+	ret = request_threaded_irq(bench.irq, bench_irq, bench_irq_thread, 0,
+				   "deferral_bench", &bench);
+	if (ret) {
+		irq_free_desc(bench.irq);
+		return ret;
+	}
+
+	init_irq_work(&bench.irq_work, bench_irq_work);
+	return 0;
+}
+
+static int __init my_init(void)
+{
+	int ret;
+
+	pr_info("%s ...\n", __func__);
+
+	mutex_init(&bench.run_lock);
+	hrtimer_init(&bench.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	bench.timer.function = bench_tick;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	tasklet_setup(&bench.tasklet, bench_tasklet);
+#else
+	tasklet_init(&bench.tasklet, bench_tasklet, 0);
+#endif
+	INIT_WORK(&bench.work, bench_work);
+
+	bench.highpri_wq = alloc_workqueue("deferral_bench", WQ_HIGHPRI, 0);
+	if (!bench.highpri_wq)
+		return -ENOMEM;
+
+	ret = bench_start_threads();
+	if (ret)
+		goto err_destroy_wq;
+
+	ret = bench_setup_irq();
+	if (ret)
+		goto err_stop_threads;
+
+	bench.debugfs = debugfs_create_dir("deferral_bench", NULL);
+	debugfs_create_file("run", S_IWUSR, bench.debugfs, NULL, &run_fops);
+	debugfs_create_file("stats", S_IRUGO, bench.debugfs, NULL, &stats_fops);
+
+	return 0;
+
+err_stop_threads:
+	bench_stop_threads();
+err_destroy_wq:
+	destroy_workqueue(bench.highpri_wq);
+	return ret;
+}
+
+static void __exit my_exit(void)
+{
+	/* no run can be in progress once the files are gone */
+	debugfs_remove_recursive(bench.debugfs);
+
+	bench_sync();
+	free_irq(bench.irq, &bench);
+	irq_free_desc(bench.irq);
+	bench_stop_threads();
+	destroy_workqueue(bench.highpri_wq);
+
+	pr_info("%s: module exit\n", __func__);
+}
+
+module_init(my_init);
+module_exit(my_exit);
+MODULE_AUTHOR("Yannik Li <yannik520@gmail.com>");
+MODULE_LICENSE("GPL");
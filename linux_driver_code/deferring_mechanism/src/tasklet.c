@@ -1,15 +1,26 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/interrupt.h>
+#include <linux/version.h>
 
 char tasklet_data[] = "tasklet example data";
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+/* since 5.9 the callback gets its tasklet, data lives around it */
+static void tasklet_work(struct tasklet_struct *t)
+{
+	pr_info("%s: data -> %s\n", __func__, tasklet_data);
+}
+
+DECLARE_TASKLET(my_tasklet, tasklet_work);
+#else
 static void tasklet_work(unsigned long data)
 {
 	pr_info("%s: data -> %s\n", __func__, (char *)data);
 }
 
 DECLARE_TASKLET(my_tasklet, tasklet_work, (unsigned long)tasklet_data);
+#endif
 
 static int __init my_init(void)
 {
@@ -2,54 +2,560 @@
 #include <linux/module.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/hash.h>
+#include <linux/bitmap.h>
+#include <linux/completion.h>
+
+/*
+ * Deferred jobs from a preallocated pool.
+ *
+ * Every possible CPU owns pool_size work items on a free list.  A submit
+ * takes one from the local CPU, the handler gives it back to the CPU that
+ * owns it, so the slab allocator is only hit when a CPU runs dry.
+ *
+ * Jobs run on a per-CPU or unbound workqueue with max_active workers.
+ * Jobs submitted with a key go to one of nr_shards shards, each a list
+ * drained in order by a single work item: jobs with the same key run one
+ * after the other, different shards run in parallel.
+ *
+ * A job submitted with a completion signals it once it ran, and
+ * job_pool_flush() waits for everything submitted before it.
+ *
+ * debugfs work_queue/stats shows the counters, writing "<n> [<keys> [<batch>]]"
+ * to work_queue/submit queues n empty jobs, spread over that many keys
+ * and submitted that many at a time.
+ */
+
+struct work_data;
+typedef void (*job_fn_t)(struct work_data *job);
+
+struct job_pool_cpu {
+	spinlock_t lock;
+	struct list_head free;
+	unsigned int nr_free;
+};
+
+struct job_stats {
+	unsigned long submitted;
+	unsigned long executed;
+	unsigned long pool_hits;
+	unsigned long fallbacks;	/* pool empty, kmalloc'ed */
+};
+
+/* jobs of the keys hashing here, run in submission order */
+struct job_shard {
+	spinlock_t lock;
+	struct list_head jobs;
+	struct work_struct work;
+};
+
+struct job_pool {
+	struct workqueue_struct *wq;
+	struct job_pool_cpu __percpu *cpu;
+	struct job_stats __percpu *stats;
+	struct work_data *items;
+	struct job_shard *shards;
+	unsigned int nr_shards;
+};
 
-struct workqueue_struct *wq;
 struct work_data {
 	struct work_struct my_work;
+	struct list_head node;
+	struct job_pool *pool;
+	struct job_pool_cpu *owner;	/* NULL when kmalloc'ed */
+	job_fn_t fn;
+	struct completion *done;	/* completed after fn, may be NULL */
+	u32 key;
 	int data;
 };
 
+#define SUBMIT_BATCH	32
+#define SUBMIT_MAX_KEYS	1024
+
+static unsigned int pool_size = 64;
+module_param(pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_size, "Work items preallocated per CPU. Default: 64");
+
+static bool unbound;
+module_param(unbound, bool, S_IRUGO);
+MODULE_PARM_DESC(unbound, "Run jobs on unbound instead of per-CPU workers. Default: N");
+
+static unsigned int max_active;
+module_param(max_active, uint, S_IRUGO);
+MODULE_PARM_DESC(max_active, "Jobs in flight per CPU (or in total when unbound), "
+		 "0 for the workqueue default. Default: 0");
+
+static unsigned int nr_shards = 16;
+module_param(nr_shards, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_shards, "Shards for keyed jobs. Default: 16");
+
+static struct job_pool *pool;
+static struct dentry *debugfs_dir;
+
+/* run the job and give its item back */
+static void job_run(struct work_data *my_data)
+{
+	struct job_pool *jp = my_data->pool;
+	struct job_pool_cpu *owner = my_data->owner;
+	struct completion *done = my_data->done;
+	unsigned long flags;
+
+	my_data->fn(my_data);
+	this_cpu_inc(jp->stats->executed);
+
+	if (!owner) {
+		kfree(my_data);
+	} else {
+		spin_lock_irqsave(&owner->lock, flags);
+		list_add(&my_data->node, &owner->free);
+		owner->nr_free++;
+		spin_unlock_irqrestore(&owner->lock, flags);
+	}
+
+	/* the item is back in the pool before the submitter hears of it */
+	if (done)
+		complete(done);
+}
+
 static void work_handler(struct work_struct *work)
 {
-	struct work_data *my_data = container_of(work,
-						 struct work_data, my_work);
+	job_run(container_of(work, struct work_data, my_work));
+}
+
+/*
+ * A work item never runs on two workers at once, so this is the only
+ * consumer of the shard.  Queued again while running, it comes back for
+ * the jobs added meanwhile.
+ */
+static void shard_handler(struct work_struct *work)
+{
+	struct job_shard *shard = container_of(work, struct job_shard, work);
+	struct work_data *my_data;
 
-	pr_info("%s: data = %d\n", __func__, my_data->data);
-	kfree(my_data);
+	for (;;) {
+		spin_lock_irq(&shard->lock);
+		my_data = list_first_entry_or_null(&shard->jobs,
+						   struct work_data, node);
+		if (my_data)
+			list_del(&my_data->node);
+		spin_unlock_irq(&shard->lock);
+
+		if (!my_data)
+			break;
+		job_run(my_data);
+		cond_resched();
+	}
 }
 
+static struct job_pool *job_pool_create(const char *name, unsigned int per_cpu,
+				        bool unbound, unsigned int max_active,
+				        unsigned int nr_shards)
+{
+	struct job_pool *jp;
+	struct job_pool_cpu *pc;
+	struct work_data *item;
+	unsigned int i, n = 0;
+	int cpu;
+
+	jp = kzalloc(sizeof(*jp), GFP_KERNEL);
+	if (!jp)
+		return NULL;
+
+	jp->cpu = alloc_percpu(struct job_pool_cpu);
+	jp->stats = alloc_percpu(struct job_stats);
+	jp->items = kvcalloc(num_possible_cpus() * per_cpu, sizeof(*jp->items),
+			     GFP_KERNEL);
+	jp->shards = kcalloc(max(nr_shards, 1U), sizeof(*jp->shards), GFP_KERNEL);
+	if (!jp->cpu || !jp->stats || (per_cpu && !jp->items) || !jp->shards)
+		goto err_free;
+
+	jp->nr_shards = max(nr_shards, 1U);
+	for (i = 0; i < jp->nr_shards; i++) {
+		spin_lock_init(&jp->shards[i].lock);
+		INIT_LIST_HEAD(&jp->shards[i].jobs);
+		INIT_WORK(&jp->shards[i].work, shard_handler);
+	}
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(jp->cpu, cpu);
+		spin_lock_init(&pc->lock);
+		INIT_LIST_HEAD(&pc->free);
+
+		for (i = 0; i < per_cpu; i++) {
+			item = &jp->items[n++];
+			INIT_WORK(&item->my_work, work_handler);
+			item->pool = jp;
+			item->owner = pc;
+			list_add_tail(&item->node, &pc->free);
+		}
+		pc->nr_free = per_cpu;
+	}
+
+	jp->wq = alloc_workqueue("%s", unbound ? WQ_UNBOUND : 0, max_active, name);
+	if (!jp->wq)
+		goto err_free;
+
+	return jp;
+
+err_free:
+	kfree(jp->shards);
+	kvfree(jp->items);
+	free_percpu(jp->stats);
+	free_percpu(jp->cpu);
+	kfree(jp);
+	return NULL;
+}
+
+static void job_pool_destroy(struct job_pool *jp)
+{
+	/* runs every job left, which returns the items */
+	destroy_workqueue(jp->wq);
+
+	kfree(jp->shards);
+	kvfree(jp->items);
+	free_percpu(jp->stats);
+	free_percpu(jp->cpu);
+	kfree(jp);
+}
+
+/*
+ * Take @n items, free ones of the local CPU under a single lock round
+ * trip, allocated ones when it runs out.  Returns how many were taken.
+ */
+static unsigned int job_get_bulk(struct job_pool *jp, struct work_data **items,
+				 unsigned int n, gfp_t gfp)
+{
+	struct job_pool_cpu *pc;
+	struct work_data *item;
+	unsigned long flags;
+	unsigned int i = 0, hits;
+
+	pc = get_cpu_ptr(jp->cpu);
+	spin_lock_irqsave(&pc->lock, flags);
+	while (i < n && !list_empty(&pc->free)) {
+		item = list_first_entry(&pc->free, struct work_data, node);
+		list_del(&item->node);
+		items[i++] = item;
+	}
+	pc->nr_free -= i;
+	spin_unlock_irqrestore(&pc->lock, flags);
+	put_cpu_ptr(jp->cpu);
+
+	hits = i;
+	this_cpu_add(jp->stats->pool_hits, hits);
+
+	for (; i < n; i++) {
+		item = kmalloc(sizeof(*item), gfp);
+		if (!item)
+			break;
+		INIT_WORK(&item->my_work, work_handler);
+		item->pool = jp;
+		item->owner = NULL;
+		items[i] = item;
+	}
+	this_cpu_add(jp->stats->fallbacks, i - hits);
+
+	return i;
+}
+
+static struct work_data *job_get(struct job_pool *jp, gfp_t gfp)
+{
+	struct work_data *item;
+
+	return job_get_bulk(jp, &item, 1, gfp) ? item : NULL;
+}
+
+static struct job_shard *job_shard_of(struct job_pool *jp, u32 key)
+{
+	return &jp->shards[hash_32(key, 32) % jp->nr_shards];
+}
+
+/*
+ * Run @fn(job) later in process context, job->data set to @data, then
+ * complete @done unless it is NULL.  Safe from any context given a
+ * matching @gfp.
+ */
+static int job_submit_done(struct job_pool *jp, job_fn_t fn, int data,
+			   struct completion *done, gfp_t gfp)
+{
+	struct work_data *item;
+
+	item = job_get(jp, gfp);
+	if (!item)
+		return -ENOMEM;
+
+	item->fn = fn;
+	item->done = done;
+	item->data = data;
+	this_cpu_inc(jp->stats->submitted);
+	queue_work(jp->wq, &item->my_work);
+
+	return 0;
+}
+
+static int job_submit(struct job_pool *jp, job_fn_t fn, int data, gfp_t gfp)
+{
+	return job_submit_done(jp, fn, data, NULL, gfp);
+}
+
+/* wait for every job submitted before, keyed or not */
+static void job_pool_flush(struct job_pool *jp)
+{
+	flush_workqueue(jp->wq);
+}
+
+/* like job_submit(), but after every job submitted earlier with @key */
+static int job_submit_key(struct job_pool *jp, u32 key, job_fn_t fn, int data,
+			  gfp_t gfp)
+{
+	struct job_shard *shard = job_shard_of(jp, key);
+	struct work_data *item;
+	unsigned long flags;
+
+	item = job_get(jp, gfp);
+	if (!item)
+		return -ENOMEM;
+
+	item->fn = fn;
+	item->done = NULL;
+	item->key = key;
+	item->data = data;
+	this_cpu_inc(jp->stats->submitted);
+
+	spin_lock_irqsave(&shard->lock, flags);
+	list_add_tail(&item->node, &shard->jobs);
+	spin_unlock_irqrestore(&shard->lock, flags);
+	queue_work(jp->wq, &shard->work);
+
+	return 0;
+}
+
+/*
+ * Submit @n jobs running @fn with @data[i], keyed by @keys[i] or unkeyed
+ * when @keys is NULL.  Items are taken from the pool at once and every
+ * shard involved is kicked once.  Returns how many were submitted, the
+ * first ones in order when the pool and the allocator ran out.
+ */
+static unsigned int job_submit_batch(struct job_pool *jp, job_fn_t fn,
+				     const int *data, const u32 *keys,
+				     unsigned int n, gfp_t gfp)
+{
+	struct work_data *items[SUBMIT_BATCH];
+	DECLARE_BITMAP(kicked, SUBMIT_BATCH);
+	struct job_shard *shard, *touched[SUBMIT_BATCH];
+	unsigned int done = 0, got, nr_touched, i, j;
+	unsigned long flags;
+
+	while (done < n) {
+		got = job_get_bulk(jp, items, min(n - done, (unsigned int)SUBMIT_BATCH), gfp);
+		if (!got)
+			break;
+
+		for (i = 0; i < got; i++) {
+			items[i]->fn = fn;
+			items[i]->done = NULL;
+			items[i]->data = data[done + i];
+		}
+		this_cpu_add(jp->stats->submitted, got);
+
+		if (!keys) {
+			for (i = 0; i < got; i++)
+				queue_work(jp->wq, &items[i]->my_work);
+			done += got;
+			continue;
+		}
+
+		/* a shard is locked and kicked once per run of its jobs */
+		bitmap_zero(kicked, SUBMIT_BATCH);
+		nr_touched = 0;
+		for (i = 0; i < got; i++) {
+			if (test_bit(i, kicked))
+				continue;
+
+			shard = job_shard_of(jp, keys[done + i]);
+			spin_lock_irqsave(&shard->lock, flags);
+			for (j = i; j < got; j++) {
+				if (test_bit(j, kicked) ||
+				    job_shard_of(jp, keys[done + j]) != shard)
+					continue;
+				items[j]->key = keys[done + j];
+				list_add_tail(&items[j]->node, &shard->jobs);
+				__set_bit(j, kicked);
+			}
+			spin_unlock_irqrestore(&shard->lock, flags);
+			touched[nr_touched++] = shard;
+		}
+		for (i = 0; i < nr_touched; i++)
+			queue_work(jp->wq, &touched[i]->work);
+
+		done += got;
+	}
+
+	return done;
+}
+
+static void job_print(struct work_data *job)
+{
+	pr_info("%s: data = %d\n", __func__, job->data);
+}
+
+static void job_nop(struct work_data *job)
+{
+}
+
+/* keyed test jobs carry increasing numbers per key */
+static int last_seq[SUBMIT_MAX_KEYS];
+static atomic_long_t out_of_order;
+
+static void job_check_order(struct work_data *job)
+{
+	if (job->data <= last_seq[job->key])
+		atomic_long_inc(&out_of_order);
+	last_seq[job->key] = job->data;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct job_stats sum = { 0 }, *s;
+	unsigned long nr_free = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(pool->stats, cpu);
+		sum.submitted += s->submitted;
+		sum.executed += s->executed;
+		sum.pool_hits += s->pool_hits;
+		sum.fallbacks += s->fallbacks;
+		nr_free += READ_ONCE(per_cpu_ptr(pool->cpu, cpu)->nr_free);
+	}
+
+	seq_printf(m, "%s workers, max_active %u, %u shards\n",
+		   unbound ? "unbound" : "per-CPU", max_active, pool->nr_shards);
+	seq_printf(m, "submitted %lu\nexecuted  %lu\npool hits %lu\nkmalloc   %lu\nfree      %lu\n",
+		   sum.submitted, sum.executed, sum.pool_hits, sum.fallbacks, nr_free);
+	seq_printf(m, "out of order %ld\n", atomic_long_read(&out_of_order));
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static DEFINE_MUTEX(submit_lock);
+
+/* n keyed jobs go round robin over the keys, batch 1 submits one by one */
+static ssize_t submit_write(struct file *file, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	int data[SUBMIT_BATCH];
+	u32 keys[SUBMIT_BATCH];
+	unsigned long n, i, done;
+	unsigned int nr_keys = 0, batch = SUBMIT_BATCH, k, got;
+	job_fn_t fn;
+	char buf[48];
+	int ret = count;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%lu %u %u", &n, &nr_keys, &batch) < 1 ||
+	    nr_keys > SUBMIT_MAX_KEYS || !batch)
+		return -EINVAL;
+	batch = min(batch, (unsigned int)SUBMIT_BATCH);
+	fn = nr_keys ? job_check_order : job_nop;
+
+	mutex_lock(&submit_lock);
+	if (nr_keys) {
+		/* nothing of an earlier run may be looking at last_seq */
+		job_pool_flush(pool);
+		memset(last_seq, 0, sizeof(last_seq));
+		atomic_long_set(&out_of_order, 0);
+	}
+
+	for (done = 0; done < n; done += got) {
+		k = min(n - done, (unsigned long)batch);
+		for (i = 0; i < k; i++) {
+			/* sequence numbers per key start at 1 */
+			data[i] = nr_keys ? (done + i) / nr_keys + 1 : done + i;
+			keys[i] = nr_keys ? (done + i) % nr_keys : 0;
+		}
+
+		if (k > 1)
+			got = job_submit_batch(pool, fn, data, nr_keys ? keys : NULL,
+					       k, GFP_KERNEL);
+		else if (nr_keys)
+			got = !job_submit_key(pool, keys[0], fn, data[0], GFP_KERNEL);
+		else
+			got = !job_submit(pool, fn, data[0], GFP_KERNEL);
+		if (got < k) {
+			ret = -ENOMEM;
+			break;
+		}
+		cond_resched();
+	}
+	mutex_unlock(&submit_lock);
+
+	return ret;
+}
+
+static const struct file_operations submit_fops = {
+	.owner = THIS_MODULE,
+	.write = submit_write,
+};
+
 static int __init my_init(void)
 {
-	struct work_data *my_data;
-	
+	DECLARE_COMPLETION_ONSTACK(done);
+	int ret;
+
 	pr_info("%s ...\n", __func__);
 
-	my_data = kmalloc(sizeof(struct work_data), GFP_KERNEL);
-	if (!my_data)
+	if (max_active > WQ_MAX_ACTIVE)
+		return -EINVAL;
+
+	pool = job_pool_create("my_work_queue", pool_size, unbound, max_active,
+			       nr_shards);
+	if (!pool)
 		return -ENOMEM;
-	my_data->data = 55;
-
-	wq = create_singlethread_workqueue("my_single_thread");
-	if (!wq)
-		goto create_workqueue_error;
-	
-	INIT_WORK(&my_data->my_work, work_handler);
-	queue_work(wq, &my_data->my_work);
-	
-	return 0;
 
-create_workqueue_error:
-	kfree(my_data);
-	return -ENOMEM;
+	debugfs_dir = debugfs_create_dir("work_queue", NULL);
+	debugfs_create_file("stats", S_IRUGO, debugfs_dir, NULL, &stats_fops);
+	debugfs_create_file("submit", S_IWUSR, debugfs_dir, NULL, &submit_fops);
+
+	ret = job_submit_done(pool, job_print, 55, &done, GFP_KERNEL);
+	if (ret) {
+		debugfs_remove_recursive(debugfs_dir);
+		job_pool_destroy(pool);
+		return ret;
+	}
+	wait_for_completion(&done);
+
+	return ret;
 }
 
 static void __exit my_exit(void)
 {
-	if (wq) {
-		flush_workqueue(wq);
-		destroy_workqueue(wq);
-	}
-	
+	debugfs_remove_recursive(debugfs_dir);
+	job_pool_destroy(pool);
+
 	pr_info("%s: module exit\n", __func__);
 }
 
@@ -5,6 +5,21 @@
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/rculist.h>
+#include <linux/mutex.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#include <linux/sched/types.h>
 
 #define VERSION "2.0"
 
@@ -24,6 +39,88 @@
 #define WHEEL_MIN_SPEED         1
 #define STEP_DEFAULT_VALUE	1
 #define STEP_GAIN_VALUE		2
+#define EVENT_FIFO_SIZE		256	/* power of two */
+#define EVENT_BATCH		16
+#define MOTION_MAX_HZ		1000
+#define HIST_BUCKETS		32	/* log2 buckets */
+#define REPORT_FIFO_PRIO	50	/* what sched_set_fifo() picks */
+
+/* held direction keys, for the timer driven motion */
+#define DIR_UP			BIT(0)
+#define DIR_DOWN		BIT(1)
+#define DIR_LEFT		BIT(2)
+#define DIR_RIGHT		BIT(3)
+
+/*
+ * What a mouse key does.  The numbers are part of the keymap format
+ * loaded through the "keymap" sysfs attribute.
+ */
+enum {
+	ACT_NONE,
+	ACT_UP,
+	ACT_DOWN,
+	ACT_LEFT,
+	ACT_RIGHT,
+	ACT_WHEEL_DOWN,
+	ACT_WHEEL_UP,
+	ACT_BTN_LEFT,
+	ACT_BTN_RIGHT,
+	ACT_MAX,
+};
+
+/* modifiers a chord can be made of */
+#define MOD_LCTRL		BIT(0)
+#define MOD_RCTRL		BIT(1)
+#define MOD_LALT		BIT(2)
+#define MOD_RALT		BIT(3)
+#define MOD_LSHIFT		BIT(4)
+#define MOD_RSHIFT		BIT(5)
+#define MOD_LMETA		BIT(6)
+#define MOD_RMETA		BIT(7)
+
+/*
+ * Keymap image, as read and written through the "keymap" attribute:
+ * this header followed by nr entries, little endian.
+ */
+#define KEYMAP_MAGIC		0x4d4b4d56	/* "VMKM" */
+#define KEYMAP_VERSION		1
+
+struct vms_keymap_hdr
+{
+	__le32	magic;
+	u8	version;
+	u8	chord;		/* MOD_* that must all be held */
+	__le16	nr;
+} __packed;
+
+struct vms_keymap_entry
+{
+	__le16	code;
+	u8	action;
+	u8	pad;
+} __packed;
+
+#define KEYMAP_MAX_ENTRIES	((PAGE_SIZE - sizeof(struct vms_keymap_hdr)) / \
+				 sizeof(struct vms_keymap_entry))
+
+/*
+ * The keymap the filter works with.  Every key it has to look at at all
+ * (mouse keys, chord modifiers, capslock) has its bit set in @keys, so
+ * everything else costs one bit test.  Replaced as a whole under RCU.
+ */
+struct vms_keymap
+{
+	struct rcu_head	rcu;
+	unsigned int	chord;
+	DECLARE_BITMAP(keys, KEY_CNT);
+	u8		action[KEY_CNT];
+};
+
+enum {
+	CURVE_FLAT,		/* always motion_speed */
+	CURVE_LINEAR,		/* motion_speed .. motion_max_speed in motion_accel_ms */
+	CURVE_QUADRATIC,	/* same range, slow start and fast finish */
+};
 
 enum {
 	KEY_VAL_UP,
@@ -31,28 +128,121 @@ enum {
 	KEY_VAL_PRESS,
 };
 
+/* who runs vms_func() for queued events */
+enum
+{
+	REPORT_SYSTEM_WQ,	/* schedule_work() */
+	REPORT_HIGHPRI_WQ,	/* our own WQ_HIGHPRI | WQ_UNBOUND workqueue */
+	REPORT_KTHREAD,		/* a SCHED_FIFO thread woken through a completion */
+	REPORT_MAX,
+};
+
+/* a mouse key event, queued by the filter for vms_func() */
+struct vms_event
+{
+	unsigned int	code;
+	unsigned int	action;
+	int		value;
+	ktime_t		time;
+};
+
 struct key_status
 {
-	int	ctrl_key_down;
-	int	alt_key_down;
-	int	capslock_key_down;
+	unsigned int	mods;		/* MOD_* held */
+	int		capslock_key_down;
+};
+
+/*
+ * State of one connected keyboard.  The filter of a keyboard runs under
+ * its input_dev's event_lock, so it is the only producer of the fifo and
+ * the keyboard's work the only consumer: the kfifo needs no lock at all.
+ */
+struct vkbd
+{
+	struct input_handle	 handle;
+	struct list_head	 node;		/* in vms->kbds, RCU */
+	struct rcu_head		 rcu;
+	struct work_struct	 work;
+	unsigned long		 pending;	/* bit 0: waiting for the report thread */
+	DECLARE_KFIFO(events, struct vms_event, EVENT_FIFO_SIZE);
+	struct key_status	 key_status;
+	DECLARE_BITMAP(grabbed, KEY_CNT);	/* mouse keys we took the press of */
+	spinlock_t		 lock;		/* everything below, vs. the motion timer */
+	bool			 keep_speed;
+	unsigned int		 move_speed;
+	int			 gear_count;
+	int			 gear_step;
+	unsigned int		 held_dirs;
+	ktime_t			 motion_start;	/* first direction key went down */
+	unsigned int		 motion_cur_speed;	/* px/s, kept while keep_speed */
+	int			 frac_x;	/* sub-pixel motion left over, 1/1000 px */
+	int			 frac_y;
+};
+
+/* bucket n counts values in [2^n, 2^(n+1)) */
+struct vms_hist
+{
+	atomic_long_t	bucket[HIST_BUCKETS];
+};
+
+/* instrumentation, shown in debugfs vmouse/stats */
+struct vms_stats
+{
+	struct vms_hist	depth;		/* events found queued when the worker ran */
+	struct vms_hist	sched_delay;	/* oldest queued event -> worker running, ns */
+	struct vms_hist	latency;	/* key event -> the input_sync carrying it, ns */
+	atomic_long_t	events;
+	atomic_long_t	reports;
+	atomic_long_t	coalesced;	/* events that shared a report with another */
+	atomic_long_t	overruns;	/* fifo full, key passed on */
 };
 
 static struct vmouse
 {
         struct input_handler	*handler;
-        struct input_handle	*handle;
         struct input_dev	*dev;
-        struct work_struct	 work;
-        int			 value;
-        unsigned int		 event_code;
-        unsigned int		 move_speed;
+	struct list_head	 kbds;		/* connected keyboards, RCU */
+	struct mutex		 kbds_lock;	/* writers of kbds */
 	unsigned int		 wheel_speed;
-	bool			 keep_speed;
-	struct key_status	 key_status;
-        spinlock_t		 lock;
+	struct vms_keymap __rcu	*keymap;
+	struct mutex		 keymap_lock;	/* writers of keymap */
+	struct hrtimer		 motion_timer;
+	bool			 motion_running;	/* the tick will run again, under lock */
+        spinlock_t		 lock;		/* keeps each report and its sync together */
+	struct workqueue_struct	*wq;		/* REPORT_HIGHPRI_WQ */
+	struct task_struct	*thread;	/* REPORT_KTHREAD */
+	struct completion	 kick;		/* wakes the thread */
+	bool			 thread_exit;
+	struct vms_stats	 stats;
+	struct dentry		*debugfs;
 }*vms;
 
+static unsigned int report_mode = REPORT_SYSTEM_WQ;
+module_param(report_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(report_mode, "Where reports are sent from: 0 system workqueue, "
+		 "1 high priority workqueue, 2 SCHED_FIFO thread. Default: 0");
+
+static unsigned int motion_hz; /* 0: move on keyboard autorepeat */
+module_param(motion_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(motion_hz, "Sample held direction keys at this rate (max "
+		 __stringify(MOTION_MAX_HZ) "). Default: 0 (follow autorepeat)");
+
+static unsigned int motion_speed = 200;
+module_param(motion_speed, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(motion_speed, "Pointer speed in px/s when a direction key goes down. Default: 200");
+
+static unsigned int motion_max_speed = 2000;
+module_param(motion_max_speed, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(motion_max_speed, "Pointer speed in px/s after full acceleration. Default: 2000");
+
+static unsigned int motion_accel_ms = 1000;
+module_param(motion_accel_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(motion_accel_ms, "Time to reach motion_max_speed. Default: 1000");
+
+static unsigned int motion_curve = CURVE_QUADRATIC;
+module_param(motion_curve, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(motion_curve, "Acceleration curve: 0 flat, 1 linear, 2 quadratic. Default: 2");
+
 #define check_val(val, max_val, min_val) do {                   \
 		(val) = (val) < (min_val) ? (min_val) :         \
 			(val) > (max_val) ? (max_val) : (val);  \
@@ -68,9 +258,9 @@ static ssize_t vmouse_wheel_speed_store(struct device *dev, struct device_attrib
 
 	check_val(wheel_speed, WHEEL_MAX_SPEED, WHEEL_MIN_SPEED);
 
-	spin_lock(&vms->lock);
+	spin_lock_irq(&vms->lock);
 	vms->wheel_speed = wheel_speed;
-	spin_unlock(&vms->lock);
+	spin_unlock_irq(&vms->lock);
 
 	return count;
 }
@@ -82,36 +272,33 @@ static ssize_t vmouse_wheel_speed_show(struct device *dev, struct device_attribu
 
 DEVICE_ATTR(wheel_speed, 0644, vmouse_wheel_speed_show, vmouse_wheel_speed_store);
 
-static void gearbox(int key_value, unsigned int *speed, bool keep_speed)
+static void gearbox(struct vkbd *kbd, int key_value)
 {
-	static int	count = 0;
-	static int	step  = STEP_DEFAULT_VALUE;
-	
 	switch(key_value)
 	{
 	case KEY_VAL_UP:
-		count = 0;
+		kbd->gear_count = 0;
 		break;
 	case KEY_VAL_DOWN:
-		count = 0;
-		if (!keep_speed)
+		kbd->gear_count = 0;
+		if (!kbd->keep_speed)
 		{
-			*speed = MOVE_DEFAULT_SPEED;
-			step = STEP_DEFAULT_VALUE;
+			kbd->move_speed = MOVE_DEFAULT_SPEED;
+			kbd->gear_step = STEP_DEFAULT_VALUE;
 		}
 		break;
 	case KEY_VAL_PRESS:
-		if (!keep_speed)
+		if (!kbd->keep_speed)
 		{
-			count++;
-			if (count == step)
+			kbd->gear_count++;
+			if (kbd->gear_count == kbd->gear_step)
 			{
-				if (*speed < MOVE_MAX_SPEED)
+				if (kbd->move_speed < MOVE_MAX_SPEED)
 				{
-					*speed =  *speed << 1;
-					step += STEP_GAIN_VALUE;
+					kbd->move_speed = kbd->move_speed << 1;
+					kbd->gear_step += STEP_GAIN_VALUE;
 				}
-				count = 0;
+				kbd->gear_count = 0;
 			}
 		}
 		break;
@@ -119,122 +306,639 @@ static void gearbox(int key_value, unsigned int *speed, bool keep_speed)
 
 }
 
-static void vms_func(struct work_struct *work)
+static unsigned int vms_dir_of(unsigned int action)
+{
+	switch(action)
+	{
+	case ACT_UP:
+		return DIR_UP;
+	case ACT_DOWN:
+		return DIR_DOWN;
+	case ACT_LEFT:
+		return DIR_LEFT;
+	case ACT_RIGHT:
+		return DIR_RIGHT;
+	}
+	return 0;
+}
+
+static unsigned int vms_mod_of(unsigned int code)
+{
+	switch(code)
+	{
+	case KEY_LEFTCTRL:
+		return MOD_LCTRL;
+	case KEY_RIGHTCTRL:
+		return MOD_RCTRL;
+	case KEY_LEFTALT:
+		return MOD_LALT;
+	case KEY_RIGHTALT:
+		return MOD_RALT;
+	case KEY_LEFTSHIFT:
+		return MOD_LSHIFT;
+	case KEY_RIGHTSHIFT:
+		return MOD_RSHIFT;
+	case KEY_LEFTMETA:
+		return MOD_LMETA;
+	case KEY_RIGHTMETA:
+		return MOD_RMETA;
+	}
+	return 0;
+}
+
+static const unsigned int vms_mod_keys[] =
 {
-        spin_lock(&vms->lock);
+	KEY_LEFTCTRL, KEY_RIGHTCTRL, KEY_LEFTALT, KEY_RIGHTALT,
+	KEY_LEFTSHIFT, KEY_RIGHTSHIFT, KEY_LEFTMETA, KEY_RIGHTMETA,
+};
 
-        switch(vms->event_code)
-        {
-	case KEY_P:
-		gearbox(vms->value, &vms->move_speed, vms->keep_speed);
-		input_report_rel(vms->dev, REL_X, 0);
-		input_report_rel(vms->dev, REL_Y, -vms->move_speed);
-		input_sync(vms->dev);
+/* set the bits of everything the filter must see, once actions are in */
+static void vms_keymap_finish(struct vms_keymap *km)
+{
+	unsigned int i;
+
+	for (i = 0; i < KEY_CNT; i++)
+		if (km->action[i])
+			__set_bit(i, km->keys);
+
+	for (i = 0; i < ARRAY_SIZE(vms_mod_keys); i++)
+		if (km->chord & vms_mod_of(vms_mod_keys[i]))
+			__set_bit(vms_mod_keys[i], km->keys);
+
+	__set_bit(KEY_CAPSLOCK, km->keys);
+}
+
+/* ctrl+alt with p/n/b/f to move, v/u to scroll, space/m for the buttons */
+static struct vms_keymap *vms_keymap_default(void)
+{
+	struct vms_keymap *km;
+
+	km = kzalloc(sizeof(struct vms_keymap), GFP_KERNEL);
+	if (!km)
+		return NULL;
+
+	km->chord		   = MOD_LCTRL | MOD_LALT;
+	km->action[KEY_P]	   = ACT_UP;
+	km->action[KEY_N]	   = ACT_DOWN;
+	km->action[KEY_B]	   = ACT_LEFT;
+	km->action[KEY_F]	   = ACT_RIGHT;
+	km->action[KEY_V]	   = ACT_WHEEL_DOWN;
+	km->action[KEY_U]	   = ACT_WHEEL_UP;
+	km->action[KEY_SPACE]	   = ACT_BTN_LEFT;
+	km->action[KEY_M]	   = ACT_BTN_RIGHT;
+	vms_keymap_finish(km);
+
+	return km;
+}
+
+static ssize_t keymap_read(struct file *filp, struct kobject *kobj,
+			   struct bin_attribute *attr, char *buf,
+			   loff_t off, size_t count)
+{
+	struct vms_keymap_hdr	*hdr;
+	struct vms_keymap_entry	*ent;
+	struct vms_keymap	*km;
+	size_t			 len;
+	unsigned int		 i, nr = 0;
+	char			*image;
+
+	image = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!image)
+		return -ENOMEM;
+
+	hdr = (struct vms_keymap_hdr *)image;
+	ent = (struct vms_keymap_entry *)(hdr + 1);
+
+	rcu_read_lock();
+	km = rcu_dereference(vms->keymap);
+	hdr->chord = km->chord;
+	for (i = 0; i < KEY_CNT && nr < KEYMAP_MAX_ENTRIES; i++)
+	{
+		if (!km->action[i])
+			continue;
+		ent[nr].code   = cpu_to_le16(i);
+		ent[nr].action = km->action[i];
+		nr++;
+	}
+	rcu_read_unlock();
+
+	hdr->magic   = cpu_to_le32(KEYMAP_MAGIC);
+	hdr->version = KEYMAP_VERSION;
+	hdr->nr      = cpu_to_le16(nr);
+	len	     = sizeof(*hdr) + nr * sizeof(*ent);
+
+	if (off >= len)
+		count = 0;
+	else
+		count = min_t(size_t, count, len - off);
+	memcpy(buf, image + off, count);
+
+	kfree(image);
+	return count;
+}
+
+/* a whole keymap image in one write replaces the current map */
+static ssize_t keymap_write(struct file *filp, struct kobject *kobj,
+			    struct bin_attribute *attr, char *buf,
+			    loff_t off, size_t count)
+{
+	struct vms_keymap_hdr	*hdr = (struct vms_keymap_hdr *)buf;
+	struct vms_keymap_entry	*ent = (struct vms_keymap_entry *)(hdr + 1);
+	struct vms_keymap	*km, *old;
+	unsigned int		 i, nr, code;
+
+	if (off || count < sizeof(*hdr) ||
+	    le32_to_cpu(hdr->magic) != KEYMAP_MAGIC || hdr->version != KEYMAP_VERSION)
+		return -EINVAL;
+
+	nr = le16_to_cpu(hdr->nr);
+	/* without a chord every mouse key would be lost for typing */
+	if (!hdr->chord || count != sizeof(*hdr) + nr * sizeof(*ent))
+		return -EINVAL;
+
+	km = kzalloc(sizeof(struct vms_keymap), GFP_KERNEL);
+	if (!km)
+		return -ENOMEM;
+
+	km->chord = hdr->chord;
+	for (i = 0; i < nr; i++)
+	{
+		code = le16_to_cpu(ent[i].code);
+		if (code >= KEY_CNT || !ent[i].action || ent[i].action >= ACT_MAX ||
+		    code == KEY_CAPSLOCK || vms_mod_of(code))
+		{
+			kfree(km);
+			return -EINVAL;
+		}
+		km->action[code] = ent[i].action;
+	}
+	vms_keymap_finish(km);
+
+	mutex_lock(&vms->keymap_lock);
+	old = rcu_dereference_protected(vms->keymap, lockdep_is_held(&vms->keymap_lock));
+	rcu_assign_pointer(vms->keymap, km);
+	mutex_unlock(&vms->keymap_lock);
+
+	kfree_rcu(old, rcu);
+
+	return count;
+}
+
+static BIN_ATTR_RW(keymap, 0);
+
+/* pointer speed in px/s, @held_ns after the first direction key went down */
+static unsigned int vms_motion_speed(s64 held_ns)
+{
+	unsigned int	lo = READ_ONCE(motion_speed);
+	unsigned int	hi = max(READ_ONCE(motion_max_speed), lo);
+	u64		ramp = (u64)READ_ONCE(motion_accel_ms) * NSEC_PER_MSEC;
+	u64		r;	/* progress of the ramp, 0 .. 1024 */
+
+	if (!ramp || held_ns >= ramp)
+		r = 1024;
+	else
+		r = div64_u64((u64)held_ns << 10, ramp);
+
+	switch(READ_ONCE(motion_curve))
+	{
+	case CURVE_FLAT:
+		return lo;
+	case CURVE_LINEAR:
 		break;
-	case KEY_N:
-		gearbox(vms->value, &vms->move_speed, vms->keep_speed);
-		input_report_rel(vms->dev, REL_X, 0);
-		input_report_rel(vms->dev, REL_Y, vms->move_speed);
-		input_sync(vms->dev);
+	default:
+		r = (r * r) >> 10;
 		break;
-	case KEY_B:
-		gearbox(vms->value, &vms->move_speed, vms->keep_speed);
-		input_report_rel(vms->dev, REL_X, -vms->move_speed);
-		input_report_rel(vms->dev, REL_Y, 0);
+	}
+
+	return lo + (unsigned int)(((u64)(hi - lo) * r) >> 10);
+}
+
+/* add @step in every held direction, opposite keys cancel out */
+static void vms_held_motion(unsigned int held_dirs, int step, int *x, int *y)
+{
+	if (held_dirs & DIR_LEFT)
+		*x -= step;
+	if (held_dirs & DIR_RIGHT)
+		*x += step;
+	if (held_dirs & DIR_UP)
+		*y -= step;
+	if (held_dirs & DIR_DOWN)
+		*y += step;
+}
+
+/* one tick of @kbd's held directions, in whole pixels; kbd->lock held */
+static void vms_motion_step(struct vkbd *kbd, ktime_t now, int *dx, int *dy)
+{
+	unsigned int	speed, step;
+	int		x, y;
+
+	if (!kbd->held_dirs)
+	{
+		kbd->frac_x = 0;
+		kbd->frac_y = 0;
+		return;
+	}
+
+	if (kbd->keep_speed && kbd->motion_cur_speed)
+		speed = kbd->motion_cur_speed;
+	else
+		speed = vms_motion_speed(ktime_to_ns(ktime_sub(now, kbd->motion_start)));
+	kbd->motion_cur_speed = speed;
+
+	/* 1/1000 px per tick */
+	step = speed * 1000 / motion_hz;
+	vms_held_motion(kbd->held_dirs, step, &kbd->frac_x, &kbd->frac_y);
+
+	x = kbd->frac_x / 1000;
+	y = kbd->frac_y / 1000;
+	kbd->frac_x -= x * 1000;
+	kbd->frac_y -= y * 1000;
+	*dx += x;
+	*dy += y;
+}
+
+/*
+ * Motion sampling: one combined REL_X/REL_Y report per tick for the held
+ * direction keys of all keyboards, whatever their autorepeat does.
+ * Fractions of a pixel are carried over, so slow speeds still move
+ * smoothly.  The timer stops once no keyboard holds a direction.
+ */
+static enum hrtimer_restart vms_motion_tick(struct hrtimer *timer)
+{
+	ktime_t			now = ktime_get();
+	struct vkbd		*kbd;
+	int			dx = 0, dy = 0;
+	bool			held = false;
+	unsigned long		flags;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(kbd, &vms->kbds, node)
+	{
+		spin_lock_irqsave(&kbd->lock, flags);
+		vms_motion_step(kbd, now, &dx, &dy);
+		spin_unlock_irqrestore(&kbd->lock, flags);
+	}
+
+	spin_lock_irqsave(&vms->lock, flags);
+	if (dx || dy)
+	{
+		input_report_rel(vms->dev, REL_X, dx);
+		input_report_rel(vms->dev, REL_Y, dy);
 		input_sync(vms->dev);
+	}
+	/*
+	 * held_dirs only changes under vms->lock, so whether to go on is
+	 * decided here, against vms_motion_key() starting the timer.
+	 */
+	list_for_each_entry_rcu(kbd, &vms->kbds, node)
+		held |= READ_ONCE(kbd->held_dirs) != 0;
+	vms->motion_running = held;
+	spin_unlock_irqrestore(&vms->lock, flags);
+	rcu_read_unlock();
+
+	if (!held)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward(timer, now, ns_to_ktime(NSEC_PER_SEC / motion_hz));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Direction keys in timer mode only change the held set, the tick moves.
+ * kbd->lock and vms->lock held.
+ */
+static void vms_motion_key(struct vkbd *kbd, const struct vms_event *ev)
+{
+	unsigned int	dir = vms_dir_of(ev->action);
+	bool		idle = !kbd->held_dirs;
+
+	switch(ev->value)
+	{
+	case KEY_VAL_DOWN:
+		kbd->held_dirs |= dir;
+		if (!idle)
+			break;
+		/* accelerate from the start, unless capslock keeps the speed */
+		kbd->motion_start = ev->time;
+		if (!kbd->keep_speed)
+			kbd->motion_cur_speed = 0;
+		/* a running timer serves this keyboard too */
+		if (!vms->motion_running)
+		{
+			vms->motion_running = true;
+			hrtimer_start(&vms->motion_timer, 0, HRTIMER_MODE_REL);
+		}
 		break;
-	case KEY_F:
-		gearbox(vms->value, &vms->move_speed, vms->keep_speed);
-		input_report_rel(vms->dev, REL_X, vms->move_speed);
-		input_report_rel(vms->dev, REL_Y, 0);
-		input_sync(vms->dev);
+	case KEY_VAL_UP:
+		kbd->held_dirs &= ~dir;
 		break;
-	case KEY_V:
-		input_report_rel(vms->dev, REL_WHEEL, -vms->wheel_speed);
-		input_sync(vms->dev);
+	}
+}
+
+static void vms_hist_add(struct vms_hist *h, s64 val)
+{
+	unsigned int b = val > 0 ? ilog2(val) : 0;
+
+	atomic_long_inc(&h->bucket[min_t(unsigned int, b, HIST_BUCKETS - 1)]);
+}
+
+/* what a batch of events adds up to, sent as one report */
+struct vms_report
+{
+	int		dx;
+	int		dy;
+	int		wheel;
+	unsigned int	nr;		/* events in this report */
+	ktime_t		time[EVENT_BATCH];
+};
+
+/* vms->lock held */
+static void vms_report(struct vms_report *r)
+{
+	ktime_t		now;
+	unsigned int	i;
+
+	input_report_rel(vms->dev, REL_X, r->dx);
+	input_report_rel(vms->dev, REL_Y, r->dy);
+	input_report_rel(vms->dev, REL_WHEEL, r->wheel);
+	input_sync(vms->dev);
+
+	now = ktime_get();
+	for (i = 0; i < r->nr; i++)
+		vms_hist_add(&vms->stats.latency, ktime_to_ns(ktime_sub(now, r->time[i])));
+	atomic_long_inc(&vms->stats.reports);
+	if (r->nr > 1)
+		atomic_long_add(r->nr - 1, &vms->stats.coalesced);
+
+	r->dx	 = 0;
+	r->dy	 = 0;
+	r->wheel = 0;
+	r->nr	 = 0;
+}
+
+/* @ev goes into the report being built */
+static void vms_report_add(struct vms_report *r, const struct vms_event *ev)
+{
+	if (r->nr < EVENT_BATCH)
+		r->time[r->nr++] = ev->time;
+}
+
+/*
+ * kbd->lock and vms->lock held.  Motion and wheel are only added up in
+ * @r, a button change closes the report, so motion before a click is
+ * sent with it and motion after it goes into the next one.
+ */
+static void vms_handle_event(struct vkbd *kbd, const struct vms_event *ev,
+			     struct vms_report *r)
+{
+	unsigned int dir = vms_dir_of(ev->action);
+
+	if (dir && motion_hz)
+	{
+		vms_motion_key(kbd, ev);
+		return;
+	}
+
+	if (dir)
+	{
+		if (ev->value == KEY_VAL_UP)
+			kbd->held_dirs &= ~dir;
+		else
+			kbd->held_dirs |= dir;
+
+		gearbox(kbd, ev->value);
+		/* every held direction moves, so two keys go diagonally */
+		if (ev->value != KEY_VAL_UP)
+		{
+			vms_held_motion(kbd->held_dirs, kbd->move_speed, &r->dx, &r->dy);
+			vms_report_add(r, ev);
+		}
+		return;
+	}
+
+        switch(ev->action)
+        {
+	case ACT_WHEEL_DOWN:
+		if (ev->value != KEY_VAL_UP)
+		{
+			r->wheel -= vms->wheel_speed;
+			vms_report_add(r, ev);
+		}
 		break;
-	case KEY_U:
-		input_report_rel(vms->dev, REL_WHEEL, vms->wheel_speed);
-		input_sync(vms->dev);
+	case ACT_WHEEL_UP:
+		if (ev->value != KEY_VAL_UP)
+		{
+			r->wheel += vms->wheel_speed;
+			vms_report_add(r, ev);
+		}
 		break;
-	case KEY_SPACE:
-		input_report_key(vms->dev, BTN_LEFT, vms->value);
-		input_sync(vms->dev);
+	case ACT_BTN_LEFT:
+		input_report_key(vms->dev, BTN_LEFT, ev->value);
+		vms_report_add(r, ev);
+		vms_report(r);
 		break;
-	case KEY_M:
-		input_report_key(vms->dev, BTN_RIGHT, vms->value);
-		input_sync(vms->dev);
+	case ACT_BTN_RIGHT:
+		input_report_key(vms->dev, BTN_RIGHT, ev->value);
+		vms_report_add(r, ev);
+		vms_report(r);
 		break;
         }
+}
+
+/*
+ * Drain everything the keyboard queued, in order, one report per batch.
+ * Only one of the work item or the report thread serves a keyboard, and
+ * neither runs concurrently with itself, so this is the only consumer of
+ * the fifo.
+ */
+static void vms_drain(struct vkbd *kbd)
+{
+	struct vms_event	events[EVENT_BATCH];
+	struct vms_report	r = { 0 };
+	unsigned int		n, i;
+
+	/* the oldest event waited for the worker since it was queued */
+	if (kfifo_peek(&kbd->events, &events[0]))
+		vms_hist_add(&vms->stats.sched_delay,
+			     ktime_to_ns(ktime_sub(ktime_get(), events[0].time)));
+	vms_hist_add(&vms->stats.depth, kfifo_len(&kbd->events));
+
+	while ((n = kfifo_out(&kbd->events, events, EVENT_BATCH)))
+	{
+		atomic_long_add(n, &vms->stats.events);
 
-        spin_unlock(&vms->lock);
+		spin_lock_irq(&kbd->lock);
+		spin_lock(&vms->lock);
+		for (i = 0; i < n; i++)
+			vms_handle_event(kbd, &events[i], &r);
+		if (r.dx || r.dy || r.wheel)
+			vms_report(&r);
+		/* events that reported nothing (releases, timer mode keys) */
+		r.nr = 0;
+		spin_unlock(&vms->lock);
+		spin_unlock_irq(&kbd->lock);
+	}
 }
 
-static bool vkbd_filter(struct input_handle *handle, unsigned int type, unsigned int code, int value)
+static void vms_func(struct work_struct *work)
 {
-	struct key_status *key = &vms->key_status;
+	vms_drain(container_of(work, struct vkbd, work));
+}
 
-        if (type == EV_KEY)
-        {
-		switch(code)
-		{
-		case KEY_LEFTCTRL:
-			key->ctrl_key_down = value;
-			if (vms->keep_speed)
-			{
-				return true;
-			}
-			break;
-		case KEY_LEFTALT:
-			key->alt_key_down = value;
-			if (vms->keep_speed)
-			{
-				return true;
-			}
-			break;
-		case KEY_CAPSLOCK:
-			if (value == KEY_VAL_DOWN)
-			{
-				key->capslock_key_down = key->capslock_key_down ? 0 : 1;
-			}
-			spin_lock(&vms->lock);
-			vms->keep_speed = key->capslock_key_down ? true : false;
-			spin_unlock(&vms->lock);
-			break;
-		default:
+static int vms_thread(void *data)
+{
+	struct vkbd *kbd;
+
+	for (;;)
+	{
+		/* kthreads take no signals, interruptible only keeps us out of the load average */
+		if (wait_for_completion_interruptible(&vms->kick))
+			continue;
+		if (READ_ONCE(vms->thread_exit))
 			break;
-		}
 
-		if (key->ctrl_key_down && key->alt_key_down)
+		rcu_read_lock();
+		list_for_each_entry_rcu(kbd, &vms->kbds, node)
 		{
-			vms->event_code = code;
-			vms->value	= value;
+			/* clear first, events queued from now on kick us again */
+			if (test_and_clear_bit(0, &kbd->pending))
+				vms_drain(kbd);
+		}
+		rcu_read_unlock();
+	}
 
-			schedule_work(&vms->work);
+	/* the wakeup of kthread_stop() does not end a completion wait, so park here */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop())
+	{
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
 
-			switch(code)
-			{
-			case KEY_P:
-			case KEY_N:
-			case KEY_B:
-			case KEY_F:
-			case KEY_SPACE:
-			case KEY_M:
-			case KEY_V:
-			case KEY_U:
-				return true;
-			default:
-				return false;
-			}
-			DBG("%u, %u\n", code, value);
+	return 0;
+}
+
+/* hand the queued events of @kbd to whoever sends the reports */
+static void vms_kick(struct vkbd *kbd)
+{
+	switch (report_mode)
+	{
+	case REPORT_HIGHPRI_WQ:
+		queue_work(vms->wq, &kbd->work);
+		break;
+	case REPORT_KTHREAD:
+		if (!test_and_set_bit(0, &kbd->pending))
+			complete(&vms->kick);
+		break;
+	default:
+		schedule_work(&kbd->work);
+		break;
+	}
+}
+
+static int vms_start_thread(void)
+{
+	struct task_struct	*thread;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	struct sched_param	 param = { .sched_priority = REPORT_FIFO_PRIO };
+#endif
+
+	thread = kthread_run(vms_thread, NULL, "vmouse");
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+	vms->thread = thread;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	sched_set_fifo(vms->thread);
+#else
+	sched_setscheduler_nocheck(vms->thread, SCHED_FIFO, &param);
+#endif
+	return 0;
+}
+
+static void vms_stop_thread(void)
+{
+	WRITE_ONCE(vms->thread_exit, true);
+	complete(&vms->kick);
+	kthread_stop(vms->thread);
+}
+
+static bool vkbd_filter(struct input_handle *handle, unsigned int type, unsigned int code, int value)
+{
+	struct vkbd		*kbd = container_of(handle, struct vkbd, handle);
+	struct key_status	*key = &kbd->key_status;
+	struct vms_keymap	*km;
+	struct vms_event	 ev;
+	unsigned int		 mod;
+
+	if (type != EV_KEY || code >= KEY_CNT)
+		return false;
+
+	/* input core calls filters under rcu_read_lock() */
+	km = rcu_dereference(vms->keymap);
+	if (!test_bit(code, km->keys))
+		return false;
+
+	mod = vms_mod_of(code);
+	if (mod)
+	{
+		if (value)
+			key->mods |= mod;
+		else
+			key->mods &= ~mod;
+		/* with capslock the chord stays with the mouse */
+		return kbd->keep_speed;
+	}
+
+	if (code == KEY_CAPSLOCK)
+	{
+		if (value == KEY_VAL_DOWN)
+		{
+			key->capslock_key_down = key->capslock_key_down ? 0 : 1;
 		}
-        }
-	return false;
+		spin_lock(&kbd->lock);
+		kbd->keep_speed = key->capslock_key_down ? true : false;
+		spin_unlock(&kbd->lock);
+		return false;
+	}
+
+	/* a key pressed with the chord is released to us, chord or not */
+	if (!test_bit(code, kbd->grabbed) &&
+	    (!km->action[code] || (key->mods & km->chord) != km->chord))
+		return false;
+
+	ev.code	  = code;
+	ev.action = km->action[code];
+	ev.value  = value;
+	ev.time	  = ktime_get();
+
+	/*
+	 * 256 events are far more than a keyboard produces between two runs
+	 * of the worker.  Should it ever fill up anyway, let the key through
+	 * instead of losing it.
+	 */
+	if (!kfifo_put(&kbd->events, ev))
+	{
+		atomic_long_inc(&vms->stats.overruns);
+		__clear_bit(code, kbd->grabbed);
+		vms_kick(kbd);
+		return false;
+	}
+
+	if (value == KEY_VAL_UP)
+		__clear_bit(code, kbd->grabbed);
+	else
+		__set_bit(code, kbd->grabbed);
+
+	vms_kick(kbd);
+	return true;
 }
 
 static int vkbd_connect(struct input_handler *handler, struct input_dev *dev,
                         const struct input_device_id *id)
 {
+        struct vkbd		*kbd;
         struct input_handle	*handle;
         int			 error;
         int			 i;
@@ -246,11 +950,17 @@ static int vkbd_connect(struct input_handler *handler, struct input_dev *dev,
         if (i == BTN_MISC && !test_bit(EV_SND, dev->evbit))
                 return -ENODEV;
        
-        handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
-        vms->handle = handle;
-        if (!handle)
+        kbd = kzalloc(sizeof(struct vkbd), GFP_KERNEL);
+        if (!kbd)
                 return -ENOMEM;
-       
+
+	INIT_WORK(&kbd->work, vms_func);
+	INIT_KFIFO(kbd->events);
+	spin_lock_init(&kbd->lock);
+	kbd->move_speed = MOVE_DEFAULT_SPEED;
+	kbd->gear_step	= STEP_DEFAULT_VALUE;
+
+        handle		= &kbd->handle;
         handle->dev	= dev;
         handle->handler = handler;
         handle->name	= "vkbd";
@@ -262,6 +972,10 @@ static int vkbd_connect(struct input_handler *handler, struct input_dev *dev,
         error = input_open_device(handle);
         if (error)
                 goto err_open_handle;
+
+	mutex_lock(&vms->kbds_lock);
+	list_add_tail_rcu(&kbd->node, &vms->kbds);
+	mutex_unlock(&vms->kbds_lock);
        
         DBG(KERN_INFO"vkbd_connect: %s\n", dev->name);
         return 0;
@@ -269,15 +983,28 @@ static int vkbd_connect(struct input_handler *handler, struct input_dev *dev,
 err_open_handle:
         input_unregister_handle(handle);
 err_register_handle:
-        kfree(handle);
+        kfree(kbd);
         return error;
 }
 
 static void vkbd_disconnect(struct input_handle *handle)
 {
+	struct vkbd *kbd = container_of(handle, struct vkbd, handle);
+
         input_close_device(handle);
         input_unregister_handle(handle);
-        kfree(handle);
+	/*
+	 * The filter is gone, so nothing queues new work for this keyboard.
+	 * The report thread only looks at it under RCU.
+	 */
+	cancel_work_sync(&kbd->work);
+
+	mutex_lock(&vms->kbds_lock);
+	list_del_rcu(&kbd->node);
+	mutex_unlock(&vms->kbds_lock);
+
+	/* the motion timer may still be looking at it */
+        kfree_rcu(kbd, rcu);
 }
 
 static void vkbd_start(struct input_handle *handle)
@@ -306,27 +1033,126 @@ static struct input_handler vkbd_handler =
         .id_table   = vkbd_ids,
 };
 
+static void vms_hist_show(struct seq_file *m, const char *name,
+			  struct vms_hist *h, const char *unit)
+{
+	unsigned long	n;
+	unsigned int	i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		n = atomic_long_read(&h->bucket[i]);
+		if (n)
+			seq_printf(m, "  %10llu - %10llu %s: %lu\n",
+				   i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1, unit, n);
+	}
+}
+
+static int vms_stats_show(struct seq_file *m, void *v)
+{
+	struct vms_stats *st = &vms->stats;
+
+	seq_printf(m, "events %ld reports %ld coalesced %ld overruns %ld\n",
+		   atomic_long_read(&st->events), atomic_long_read(&st->reports),
+		   atomic_long_read(&st->coalesced), atomic_long_read(&st->overruns));
+	vms_hist_show(m, "queue depth", &st->depth, "events");
+	vms_hist_show(m, "worker scheduling delay", &st->sched_delay, "ns");
+	vms_hist_show(m, "key to report latency", &st->latency, "ns");
+
+	return 0;
+}
+
+static int vms_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vms_stats_show, NULL);
+}
+
+/* any write clears the statistics */
+static ssize_t vms_stats_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vms_stats	*st = &vms->stats;
+	struct vms_hist		*h[] = { &st->depth, &st->sched_delay, &st->latency };
+	unsigned int		 i, j;
+
+	for (i = 0; i < ARRAY_SIZE(h); i++)
+		for (j = 0; j < HIST_BUCKETS; j++)
+			atomic_long_set(&h[i]->bucket[j], 0);
+	atomic_long_set(&st->events, 0);
+	atomic_long_set(&st->reports, 0);
+	atomic_long_set(&st->coalesced, 0);
+	atomic_long_set(&st->overruns, 0);
+
+	return count;
+}
+
+static const struct file_operations vms_stats_fops =
+{
+	.owner	 = THIS_MODULE,
+	.open	 = vms_stats_open,
+	.read	 = seq_read,
+	.write	 = vms_stats_write,
+	.llseek	 = seq_lseek,
+	.release = single_release,
+};
+
 static int __init vmouse_init(void)
 {
         int error;
 
         vms		 = kzalloc(sizeof(struct vmouse),GFP_KERNEL);
+        if (!vms)
+                return -ENOMEM;
+
         vms->handler	 = &vkbd_handler;
-        vms->move_speed  = MOVE_DEFAULT_SPEED;
 	vms->wheel_speed = WHEEL_DEFAULT_SPEED;
 
-	INIT_WORK(&vms->work,vms_func);
+	INIT_LIST_HEAD(&vms->kbds);
+	mutex_init(&vms->kbds_lock);
+	mutex_init(&vms->keymap_lock);
+	RCU_INIT_POINTER(vms->keymap, vms_keymap_default());
+	if (!rcu_access_pointer(vms->keymap))
+	{
+		error = -ENOMEM;
+		goto err_free_vms;
+	}
+	if (motion_hz > MOTION_MAX_HZ)
+		motion_hz = MOTION_MAX_HZ;
+	hrtimer_init(&vms->motion_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	vms->motion_timer.function = vms_motion_tick;
 	spin_lock_init(&vms->lock);
+	init_completion(&vms->kick);
 
-        error = input_register_handler(&vkbd_handler);
-        if (error)
-                return error;
+	if (report_mode >= REPORT_MAX)
+	{
+		printk(KERN_ERR"vmouse: invalid report_mode %u.\n", report_mode);
+		error = -EINVAL;
+		goto err_free_keymap;
+	}
+	if (report_mode == REPORT_HIGHPRI_WQ)
+	{
+		vms->wq = alloc_workqueue("vmouse", WQ_HIGHPRI | WQ_UNBOUND, 0);
+		if (!vms->wq)
+		{
+			error = -ENOMEM;
+			goto err_free_keymap;
+		}
+	}
+	if (report_mode == REPORT_KTHREAD)
+	{
+		error = vms_start_thread();
+		if (error)
+			goto err_free_keymap;
+	}
 
+	/* the output device first, keyboards start reporting as soon as they connect */
         vms->dev = input_allocate_device();
         if (!vms->dev)
         {
                 printk(KERN_ERR"vmouse: failed to allocate the input device.\n");
-                return -1;
+                error = -ENOMEM;
+                goto err_stop_report;
         }
 
         vms->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_REL);
@@ -336,20 +1162,64 @@ static int __init vmouse_init(void)
         vms->dev->name = "vmouse";
         vms->dev->phys = "vmouse";
 
-        input_register_device(vms->dev);
+        error = input_register_device(vms->dev);
+        if (error)
+        {
+                input_free_device(vms->dev);
+                goto err_stop_report;
+        }
         sysfs_create_file(&vms->dev->dev.kobj, (const struct attribute *)&dev_attr_wheel_speed);
+	sysfs_create_bin_file(&vms->dev->dev.kobj, &bin_attr_keymap);
+
+	vms->debugfs = debugfs_create_dir("vmouse", NULL);
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, vms->debugfs, NULL, &vms_stats_fops);
+
+        error = input_register_handler(&vkbd_handler);
+        if (error)
+                goto err_unregister_dev;
        
         DBG(KERN_INFO"vmouse installed\n");
         return 0;
+
+err_unregister_dev:
+	debugfs_remove_recursive(vms->debugfs);
+	sysfs_remove_bin_file(&vms->dev->dev.kobj, &bin_attr_keymap);
+        sysfs_remove_file(&vms->dev->dev.kobj, (const struct attribute *)&dev_attr_wheel_speed);
+        input_unregister_device(vms->dev);
+err_stop_report:
+	if (vms->thread)
+		vms_stop_thread();
+	if (vms->wq)
+		destroy_workqueue(vms->wq);
+err_free_keymap:
+	kfree(rcu_access_pointer(vms->keymap));
+err_free_vms:
+        kfree(vms);
+        return error;
 }
 
 static void __exit vmouse_exit(void)
 {
+	/* disconnects every keyboard, which also stops their work */
+        input_unregister_handler(vms->handler);
+	hrtimer_cancel(&vms->motion_timer);
+	/* wait for the keyboards freed by RCU */
+	rcu_barrier();
+
+	debugfs_remove_recursive(vms->debugfs);
+
+	/* no keyboard left to kick them */
+	if (vms->thread)
+		vms_stop_thread();
+	if (vms->wq)
+		destroy_workqueue(vms->wq);
+
+	sysfs_remove_bin_file(&vms->dev->dev.kobj, &bin_attr_keymap);
         sysfs_remove_file(&vms->dev->dev.kobj, (const struct attribute *)&dev_attr_wheel_speed);
-        if (vms->dev)
-		input_unregister_device(vms->dev);
+	input_unregister_device(vms->dev);
 
-        input_unregister_handler(vms->handler);
+	/* replaced keymaps were freed by the rcu_barrier() above */
+	kfree(rcu_access_pointer(vms->keymap));
         kfree(vms);
 }
 
@@ -0,0 +1,200 @@
+/*
+ * Report latency of vmouse under CPU load.
+ *
+ * Creates a uinput keyboard, which vmouse attaches to like to any other,
+ * keeps every CPU busy with hog threads and taps the "right" key of the
+ * default keymap (ctrl+alt+f) at a fixed rate.  The latency histograms
+ * are then read back from debugfs vmouse/stats.
+ *
+ * To compare the report modes:
+ *
+ *	for m in 0 1 2; do
+ *		insmod vmouse.ko report_mode=$m
+ *		./vmouse_bench -n 5000 -r 500
+ *		rmmod vmouse
+ *	done
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#define STATS_PATH	"/sys/kernel/debug/vmouse/stats"
+#define MODE_PATH	"/sys/module/vmouse/parameters/report_mode"
+
+static volatile int stop;
+
+static void *hog(void *arg)
+{
+	volatile unsigned long n = 0;
+
+	while (!stop)
+		n++;
+
+	return NULL;
+}
+
+static int emit(int fd, unsigned int type, unsigned int code, int value)
+{
+	struct input_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type	 = type;
+	ev.code	 = code;
+	ev.value = value;
+
+	return write(fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+static int key(int fd, unsigned int code, int value)
+{
+	if (emit(fd, EV_KEY, code, value) < 0)
+		return -1;
+	return emit(fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static int uinput_create(void)
+{
+	static const unsigned int keys[] = { KEY_LEFTCTRL, KEY_LEFTALT, KEY_F };
+	struct uinput_user_dev	  dev;
+	unsigned int		  i;
+	int			  fd;
+
+	fd = open("/dev/uinput", O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+		ioctl(fd, UI_SET_KEYBIT, keys[i]);
+
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "vmouse-bench");
+	dev.id.bustype = BUS_VIRTUAL;
+
+	if (write(fd, &dev, sizeof(dev)) != sizeof(dev) || ioctl(fd, UI_DEV_CREATE) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int write_file(const char *path, const char *str)
+{
+	int fd = open(path, O_WRONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = write(fd, str, strlen(str));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static void cat_file(const char *path)
+{
+	char	buf[4096];
+	ssize_t	n;
+	int	fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		printf("%s: %s\n", path, strerror(errno));
+		return;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int	 count = 2000, rate = 200, nr_hogs = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	pthread_t	*hogs;
+	struct timespec	 next;
+	unsigned int	 i;
+	int		 fd, opt;
+
+	while ((opt = getopt(argc, argv, "n:r:j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'j':
+			nr_hogs = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-n events] [-r events/s] [-j hog threads]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!rate)
+		rate = 1;
+
+	fd = uinput_create();
+	if (fd < 0)
+	{
+		printf("uinput: %s\n", strerror(errno));
+		return 1;
+	}
+	/* give vmouse time to connect to the new keyboard */
+	sleep(1);
+
+	hogs = calloc(nr_hogs, sizeof(*hogs));
+	for (i = 0; hogs && i < nr_hogs; i++)
+		pthread_create(&hogs[i], NULL, hog, NULL);
+
+	if (write_file(STATS_PATH, "0") < 0)
+		printf("%s: %s\n", STATS_PATH, strerror(errno));
+
+	key(fd, KEY_LEFTCTRL, 1);
+	key(fd, KEY_LEFTALT, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < count; i++)
+	{
+		next.tv_nsec += 1000000000 / rate;
+		if (next.tv_nsec >= 1000000000)
+		{
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		key(fd, KEY_F, 1);
+		key(fd, KEY_F, 0);
+	}
+
+	key(fd, KEY_LEFTALT, 0);
+	key(fd, KEY_LEFTCTRL, 0);
+	/* let the last reports go out before reading */
+	usleep(100000);
+
+	stop = 1;
+	for (i = 0; hogs && i < nr_hogs; i++)
+		pthread_join(hogs[i], NULL);
+	free(hogs);
+
+	printf("report_mode ");
+	cat_file(MODE_PATH);
+	printf("%u events at %u/s, %u hog threads\n", count, rate, nr_hogs);
+	cat_file(STATS_PATH);
+
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+	return 0;
+}
@@ -7,82 +7,1687 @@
 #include <linux/can/led.h>
 #include <linux/can/dev.h>
 #include <linux/can/skb.h>
+#include <linux/jhash.h>
+#include <linux/ethtool.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/delay.h>
 
 #define VCAN_FIFO_DEPTH 4
+#define VCAN_NAPI_WEIGHT 64
+#define VCAN_RX_BACKLOG 1024
+#define VCAN_BURST_MAX 64		/* flush an xmit_more burst at the latest here */
+#define VCAN_MAX_QUEUES 16
+#define VCAN_MAX_IFACES 32
+#define VCAN_FILTER_MAX_IDS 4096
+#define VCAN_FILTER_MAX_RULES 16
+#define VCAN_FILTER_EMPTY 0xffffffff	/* never a valid filter key */
+#define VCAN_HIST_BUCKETS 32		/* log2 of nanoseconds */
+#define VCAN_GEN_MARK 0x7663616e	/* skb->mark of generated frames */
+
+/* one per TX queue, frames sent on TX queue n are received on RX queue n */
+struct vcan_rxq {
+	struct napi_struct napi;
+	struct sk_buff_head skbs;	/* echoed frames waiting for vcan_poll() */
+	struct sk_buff_head burst;	/* sent frames waiting for the end of the burst,
+					 * only touched under the TX queue lock */
+	struct sk_buff_head free;	/* consumed frames, freed in bulk by vcan_poll(),
+					 * under the lock of skbs */
+} ____cacheline_aligned_in_smp;
+
+struct vcan_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 rx_dropped;		/* RX backlog full */
+	u64 echo_clones;	/* echo skb had to be cloned */
+	u64 invalid;		/* malformed frames refused on TX */
+	u64 filtered;		/* RX frames rejected by the acceptance filter */
+	struct u64_stats_sync syncp;
+};
+
+enum {
+	VCAN_RULE_MASK,		/* (id & mask) == (rule id & mask) */
+	VCAN_RULE_RANGE,	/* rule id <= id <= last */
+};
+
+struct vcan_filter_rule {
+	u32 id;
+	u32 mask;
+	u32 last;
+	u8 type;
+};
+
+struct vcan_filter {
+	struct rcu_head rcu;
+	unsigned int nr_rules;
+	struct vcan_filter_rule rules[VCAN_FILTER_MAX_RULES];
+	unsigned int nr_ids;
+	unsigned int hash_bits;
+	u32 *ids;		/* accepted IDs in insertion order */
+	u32 *hash;		/* open addressed set of the same IDs */
+	u32 data[];
+};
+
+enum {
+	VCAN_TOPO_LOOP,		/* every interface on its own */
+	VCAN_TOPO_BUS,		/* all interfaces on one shared bus */
+	VCAN_TOPO_PAIR,		/* can0<->can1, can2<->can3, ... */
+};
+
+/* all interfaces created by one probe, linked according to topology */
+struct vcan_fabric {
+	unsigned int nr;
+	int topology;
+	struct net_device __rcu *ndev[];
+};
+
+/* latency histogram, bucket n counts samples in [2^n, 2^(n+1)) ns */
+struct vcan_hist {
+	atomic_long_t bucket[VCAN_HIST_BUCKETS];
+};
+
+/* traffic generator, driven through debugfs */
+struct vcan_gen {
+	struct mutex lock;
+	struct task_struct *task;
+
+	/* stream configuration */
+	u64 frames;		/* 0: until stopped */
+	u32 rate;		/* frames/s, 0: as fast as possible */
+	u32 id_lo;
+	u32 id_hi;
+	bool id_random;		/* else IDs are cycled in order */
+	int dlc;		/* -1: random */
+	bool fd;
+	bool brs;
+	bool eff;
+	unsigned int queue;
+
+	/* results of the last run */
+	bool running;
+	u64 sent;
+	u64 busy;		/* TX queue stopped, frame retried */
+	u64 alloc_fail;
+	u64 start_ns;
+	u64 end_ns;
+	u64 dropped_base;
+	u64 filtered_base;
+
+	/* generated frames received on this interface, with their latency */
+	atomic64_t received;
+	struct vcan_hist lat;
+};
+
+/* what one burst flush hands over to vcan_poll() */
+struct vcan_burst {
+	struct sk_buff_head rx;		/* echoes to receive */
+	struct sk_buff_head free;	/* frames nobody needs any more */
+};
+
+/* private area of skb->cb, valid between xmit and vcan_poll() */
+struct vcan_skb_cb {
+	ktime_t sent;			/* generator send time */
+	ktime_t tx;			/* ndo_start_xmit time of an echo, 0: none */
+};
+
+#define VCAN_SKB_CB(skb) ((struct vcan_skb_cb *)(skb)->cb)
+
+/* one frame in the emulated controller's TX FIFO */
+struct vcan_txslot {
+	ktime_t done;		/* end of transmission on the wire */
+	u64 wire_ns;
+	struct sk_buff *skb;	/* frames without echo; echoes sit in echo_skb[] */
+	unsigned int qid;
+	bool loop;
+};
 
 struct vcan_priv {
 	struct can_priv can;
 	struct net_device *ndev;
+	struct vcan_fabric *fabric;
+	unsigned int index;
+	struct vcan_pcpu_stats __percpu *stats;
+	struct vcan_filter __rcu *filter;	/* NULL: accept everything */
+	struct mutex filter_lock;
+
+	/* bus timing emulation, active when a bitrate is configured */
+	bool timed;
+	spinlock_t tx_lock;
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	struct vcan_txslot tx[VCAN_FIFO_DEPTH];
+	struct hrtimer tx_timer;
+	ktime_t bus_free;
+	ktime_t load_start;
+	ktime_t load_stamp;
+	u64 load_busy;
+	unsigned int load_permille;
+
+	struct dentry *debugfs;
+	struct vcan_gen gen;
+	bool echo_lat_on;
+	struct vcan_hist echo_lat;	/* ndo_start_xmit -> echo in vcan_poll() */
+
+	unsigned int nr_queues;
+	struct vcan_rxq rxq[VCAN_MAX_QUEUES];
+};
+
+/*
+ * Counters are only touched from the xmit path and NAPI, both with BH
+ * disabled, so the local CPU's copy can be updated without atomics.
+ */
+#define vcan_stats_inc(priv, field)					\
+	do {								\
+		struct vcan_pcpu_stats *__s = this_cpu_ptr((priv)->stats); \
+									\
+		u64_stats_update_begin(&__s->syncp);			\
+		__s->field++;						\
+		u64_stats_update_end(&__s->syncp);			\
+	} while (0)
+
+static void vcan_stats_rx(struct vcan_priv *priv, unsigned int len)
+{
+	struct vcan_pcpu_stats *s = this_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->rx_packets++;
+	s->rx_bytes += len;
+	u64_stats_update_end(&s->syncp);
+}
+
+static void vcan_hist_add(struct vcan_hist *h, s64 ns)
+{
+	unsigned int b = ns > 0 ? ilog2(ns) : 0;
+
+	atomic_long_inc(&h->bucket[min_t(unsigned int, b, VCAN_HIST_BUCKETS - 1)]);
+}
+
+static void vcan_hist_reset(struct vcan_hist *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < VCAN_HIST_BUCKETS; i++)
+		atomic_long_set(&h->bucket[i], 0);
+}
+
+static void vcan_hist_show(struct seq_file *m, struct vcan_hist *h)
+{
+	unsigned long n;
+	unsigned int i;
+
+	for (i = 0; i < VCAN_HIST_BUCKETS; i++) {
+		n = atomic_long_read(&h->bucket[i]);
+		if (n)
+			seq_printf(m, "  %10llu - %10llu ns: %lu\n",
+				   i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1, n);
+	}
+}
+
+static void vcan_stats_tx(struct vcan_priv *priv, unsigned int len)
+{
+	struct vcan_pcpu_stats *s = this_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->tx_packets++;
+	s->tx_bytes += len;
+	u64_stats_update_end(&s->syncp);
+}
+
+enum {
+	VCAN_QUEUE_BY_CPU,
+	VCAN_QUEUE_BY_ID,
+};
+
+struct platform_device *vcan_dev;
+
+static bool echo; /* echo testing. Default: 0 (Off) */
+module_param(echo, bool, S_IRUGO);
+MODULE_PARM_DESC(echo, "Echo sent frames (for testing). Default: 0 (Off)");
+
+static unsigned int queues; /* 0: one per online CPU */
+module_param(queues, uint, S_IRUGO);
+MODULE_PARM_DESC(queues, "Number of TX/RX queues (max " __stringify(VCAN_MAX_QUEUES)
+		 "). Default: 0 (one per online CPU)");
+
+static char *queue_by = "cpu";
+module_param(queue_by, charp, S_IRUGO);
+MODULE_PARM_DESC(queue_by, "TX queue selection: \"cpu\" (sending CPU) or \"id\" "
+		 "(hash of the CAN ID, keeps each ID in order). Default: cpu");
+
+static int vcan_queue_policy;
+
+static unsigned int nr_ifaces = 1;
+module_param(nr_ifaces, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_ifaces, "Number of interfaces to create (max "
+		 __stringify(VCAN_MAX_IFACES) "). Default: 1");
+
+static char *topology = "loop";
+module_param(topology, charp, S_IRUGO);
+MODULE_PARM_DESC(topology, "How interfaces are wired: \"loop\" (independent), "
+		 "\"bus\" (one shared bus) or \"pair\" (peer pairs). Default: loop");
+
+static int vcan_topology;
+
+/*
+ * Acceptance filter, the software version of a controller's filter bank.
+ * Exact IDs live in an open addressed hash set, the few mask/range rules
+ * are scanned linearly.  Readers only take rcu_read_lock(), writers
+ * (sysfs) build a new filter and swap it in under filter_lock.
+ */
+static inline u32 vcan_filter_key(canid_t id)
+{
+	return id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+}
+
+static struct vcan_filter *vcan_filter_alloc(unsigned int nr_ids)
+{
+	struct vcan_filter *f;
+	unsigned int size = nr_ids ? roundup_pow_of_two(nr_ids * 2) : 0;
+
+	f = kvzalloc(sizeof(*f) + (nr_ids + size) * sizeof(u32), GFP_KERNEL);
+	if (!f)
+		return NULL;
+
+	f->ids = f->data;
+	f->hash = f->data + nr_ids;
+	f->hash_bits = size ? ilog2(size) : 0;
+	memset(f->hash, 0xff, size * sizeof(u32));
+
+	return f;
+}
+
+static void vcan_filter_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct vcan_filter, rcu));
+}
+
+static bool vcan_filter_has_id(const struct vcan_filter *f, u32 key)
+{
+	u32 mask, i;
+
+	if (!f->nr_ids)
+		return false;
+
+	mask = (1U << f->hash_bits) - 1;
+	for (i = hash_32(key, f->hash_bits); f->hash[i] != VCAN_FILTER_EMPTY;
+	     i = (i + 1) & mask)
+		if (f->hash[i] == key)
+			return true;
+
+	return false;
+}
+
+/* f->ids/hash must have room, returns false for a duplicate */
+static bool vcan_filter_add_id(struct vcan_filter *f, u32 key)
+{
+	u32 mask = (1U << f->hash_bits) - 1;
+	u32 i;
+
+	for (i = hash_32(key, f->hash_bits); f->hash[i] != VCAN_FILTER_EMPTY;
+	     i = (i + 1) & mask)
+		if (f->hash[i] == key)
+			return false;
+
+	f->hash[i] = key;
+	f->ids[f->nr_ids++] = key;
+	return true;
+}
+
+static bool vcan_filter_accept(struct vcan_priv *priv, canid_t can_id)
+{
+	const struct vcan_filter *f;
+	u32 key = vcan_filter_key(can_id);
+	bool accept = true;
+	unsigned int i;
+
+	/* error frames are not subject to acceptance filtering */
+	if (can_id & CAN_ERR_FLAG)
+		return true;
+
+	rcu_read_lock();
+	f = rcu_dereference(priv->filter);
+	if (f && (f->nr_ids || f->nr_rules)) {
+		accept = vcan_filter_has_id(f, key);
+		for (i = 0; !accept && i < f->nr_rules; i++) {
+			const struct vcan_filter_rule *r = &f->rules[i];
+
+			if (r->type == VCAN_RULE_MASK)
+				accept = (key & r->mask) == (r->id & r->mask);
+			else
+				accept = key >= r->id && key <= r->last;
+		}
+	}
+	rcu_read_unlock();
+
+	return accept;
+}
+
+/*
+ * Queue a frame for reception.  Delivery happens in vcan_poll(), so a burst
+ * of echoed frames costs one NET_RX softirq instead of one per frame.  With
+ * @batch the frame is only collected there, vcan_rx_splice() then hands
+ * the whole batch over with one lock round trip.
+ */
+static void vcan_rx(struct sk_buff *skb, struct net_device *ndev, unsigned int qid,
+		    struct sk_buff_head *batch)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_rxq *rxq = &priv->rxq[qid];
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+
+	if (skb_queue_len(&rxq->skbs) + (batch ? skb_queue_len(batch) : 0) >=
+	    VCAN_RX_BACKLOG) {
+		vcan_stats_inc(priv, rx_dropped);
+		kfree_skb(skb);
+		return;
+	}
+
+	vcan_stats_rx(priv, cfd->len);
+
+	skb->pkt_type  = PACKET_BROADCAST;
+	skb->dev       = ndev;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	/* software RX timestamp, the stack would take a later one itself */
+	__net_timestamp(skb);
+
+	if (batch) {
+		__skb_queue_tail(batch, skb);
+		return;
+	}
+
+	skb_queue_tail(&rxq->skbs, skb);
+	napi_schedule(&rxq->napi);
+}
+
+static void vcan_rx_splice(struct net_device *ndev, unsigned int qid,
+			   struct vcan_burst *burst)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_rxq *rxq = &priv->rxq[qid];
+	unsigned long flags;
+
+	if (skb_queue_empty(&burst->rx) && skb_queue_empty(&burst->free))
+		return;
+
+	spin_lock_irqsave(&rxq->skbs.lock, flags);
+	skb_queue_splice_tail_init(&burst->rx, &rxq->skbs);
+	skb_queue_splice_tail_init(&burst->free, &rxq->free);
+	spin_unlock_irqrestore(&rxq->skbs.lock, flags);
+
+	napi_schedule(&rxq->napi);
+}
+
+static int vcan_poll(struct napi_struct *napi, int budget)
+{
+	struct vcan_rxq *rxq = container_of(napi, struct vcan_rxq, napi);
+	struct sk_buff_head free;
+	struct sk_buff *skb;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	int work = 0;
+
+	__skb_queue_head_init(&free);
+
+	/* take up to a budget of frames with one lock round trip ... */
+	spin_lock_irqsave(&rxq->skbs.lock, flags);
+	while (work < budget && (skb = __skb_dequeue(&rxq->skbs))) {
+		list_add_tail(&skb->list, &batch);
+		work++;
+	}
+	skb_queue_splice_init(&rxq->free, &free);
+	spin_unlock_irqrestore(&rxq->skbs.lock, flags);
+
+	/* transmitted frames go back to the per-CPU skb cache in bulk */
+	while ((skb = __skb_dequeue(&free)))
+		napi_consume_skb(skb, budget);
+
+	if (work) {
+		struct vcan_priv *priv = netdev_priv(napi->dev);
+		ktime_t now = ktime_get_real();
+
+		list_for_each_entry(skb, &batch, list) {
+			struct vcan_skb_cb *cb = VCAN_SKB_CB(skb);
+
+			if (cb->tx)
+				vcan_hist_add(&priv->echo_lat,
+					      ktime_to_ns(ktime_sub(now, cb->tx)));
+			if (skb->mark != VCAN_GEN_MARK)
+				continue;
+			vcan_hist_add(&priv->gen.lat, ktime_to_ns(ktime_sub(now, cb->sent)));
+			atomic64_inc(&priv->gen.received);
+		}
+	}
+
+	/* ... and hand them to the CAN core as one list */
+	netif_receive_skb_list(&batch);
+
+	if (work < budget)
+		napi_complete_done(napi, work);
+
+	return work;
+}
+
+/*
+ * Hand a frame to a running peer.  With @give the peer gets the frame
+ * itself instead of a clone, the caller is done with it.
+ */
+static void vcan_deliver_peer(struct sk_buff *skb, struct net_device *peer,
+			      unsigned int qid, bool give)
+{
+	struct vcan_priv *ppriv = netdev_priv(peer);
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	struct sk_buff *nskb = skb;
+
+	/*
+	 * Drop what the peer does not listen to before it costs a clone and
+	 * an RX softirq.  Like a controller's acceptance filter this only
+	 * sees frames from other nodes, never the echo of our own.
+	 */
+	if (!vcan_filter_accept(ppriv, cfd->can_id)) {
+		vcan_stats_inc(ppriv, filtered);
+		if (give)
+			consume_skb(skb);
+		return;
+	}
+
+	if (give && !skb_shared(skb)) {
+		/* without its owning socket, so the peer sees a foreign frame */
+		skb_orphan(skb);
+	} else {
+		/* a clone has no owning socket either */
+		nskb = skb_clone(skb, GFP_ATOMIC);
+		if (give)
+			consume_skb(skb);
+		if (!nskb) {
+			vcan_stats_inc(ppriv, rx_dropped);
+			return;
+		}
+	}
+	/* reset the CAN GW hop counter, as a real bus would */
+	nskb->csum_start = 0;
+	/* not an echo for the peer's latency histogram */
+	VCAN_SKB_CB(nskb)->tx = 0;
+
+	vcan_rx(nskb, peer, qid % ppriv->nr_queues, NULL);
+}
+
+/*
+ * Put a transmitted frame on the wire: hand it to every linked interface.
+ * With @give the last receiver gets the frame itself, returns whether it
+ * did so.
+ */
+static bool vcan_fabric_xmit(struct sk_buff *skb, struct net_device *ndev,
+			     unsigned int qid, bool give)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_fabric *fabric = priv->fabric;
+	struct net_device *peer, *last = NULL;
+	unsigned int i;
+
+	switch (fabric->topology) {
+	case VCAN_TOPO_BUS:
+		for (i = 0; i < fabric->nr; i++) {
+			if (i == priv->index)
+				continue;
+			peer = rcu_dereference_bh(fabric->ndev[i]);
+			if (!peer || !netif_running(peer))
+				continue;
+			if (last)
+				vcan_deliver_peer(skb, last, qid, false);
+			last = peer;
+		}
+		break;
+	case VCAN_TOPO_PAIR:
+		if ((priv->index ^ 1) >= fabric->nr)
+			break;
+		peer = rcu_dereference_bh(fabric->ndev[priv->index ^ 1]);
+		if (peer && netif_running(peer))
+			last = peer;
+		break;
+	}
+
+	if (!last)
+		return false;
+
+	vcan_deliver_peer(skb, last, qid, give);
+	return give;
+}
+
+/* free now, or in bulk from vcan_poll() when part of a burst */
+static void vcan_tx_free(struct sk_buff *skb, struct vcan_burst *burst)
+{
+	if (burst)
+		__skb_queue_tail(&burst->free, skb);
+	else
+		consume_skb(skb);
+}
+
+/*
+ * The frame has left the wire: hand it to the peers and echo it, into
+ * @burst when given.  Whoever is the only one left to need the frame
+ * gets the original skb, so the common cases (echo only, or one peer
+ * and no echo) never clone.
+ */
+static void vcan_tx_done(struct sk_buff *skb, struct net_device *ndev,
+			 unsigned int qid, bool loop, struct vcan_burst *burst)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	bool do_echo = echo && loop;
+
+	if (!echo && loop) {
+		/*
+		 * no echo handling available inside this driver, only
+		 * count the packets here, because the CAN core already
+		 * did the echo for us
+		 */
+		vcan_stats_rx(priv, cfd->len);
+	}
+
+	if (priv->fabric->topology != VCAN_TOPO_LOOP &&
+	    vcan_fabric_xmit(skb, ndev, qid, !do_echo))
+		return;
+
+	if (!do_echo) {
+		/* no looped packets => no counting */
+		vcan_tx_free(skb, burst);
+		return;
+	}
+
+	/* perform standard echo handling for CAN network interfaces */
+
+	if (skb_shared(skb))
+		vcan_stats_inc(priv, echo_clones);
+	/* the skb itself unless someone else holds a reference */
+	skb = can_create_echo_skb(skb);
+	if (!skb)
+		return;
+
+	/* receive with packet counting, on the queue it was sent from */
+	vcan_rx(skb, ndev, qid, burst ? &burst->rx : NULL);
+}
+
+/*
+ * Time on the wire, split into bits sent at the nominal and at the data
+ * bitrate.  Bit stuffing is accounted for as the worst case, one stuff
+ * bit per four bits of the stuffed fields.
+ */
+static void vcan_frame_bits(const struct sk_buff *skb, u32 *nbits, u32 *dbits)
+{
+	const struct canfd_frame *cfd = (const struct canfd_frame *)skb->data;
+	bool eff = cfd->can_id & CAN_EFF_FLAG;
+	u32 arb, data, crc;
+
+	if (skb->len != CANFD_MTU) {
+		u32 len = (cfd->can_id & CAN_RTR_FLAG) ? 0 : cfd->len;
+
+		/* SOF..CRC stuffed, then CRC delimiter, ACK, EOF and IFS */
+		arb = (eff ? 54 : 34) + 8 * len;
+		*nbits = arb + (arb - 1) / 4 + 1 + 2 + 7 + 3;
+		*dbits = 0;
+		return;
+	}
+
+	/* SOF, ID(s), RRS/SRR, IDE, FDF, res, BRS */
+	arb = eff ? 36 : 17;
+	/* ESI, DLC, data, then stuff count and CRC with fixed stuff bits */
+	data = 1 + 4 + 8 * cfd->len;
+	data += data / 4;
+	crc = cfd->len > 16 ? 21 : 17;
+	data += 4 + crc + (4 + crc + 3) / 4;
+
+	*nbits = arb + (arb - 1) / 4 + 1 + 2 + 7 + 3;
+	if (cfd->flags & CANFD_BRS) {
+		*dbits = data;
+	} else {
+		*nbits += data;
+		*dbits = 0;
+	}
+}
+
+static u64 vcan_frame_time(struct vcan_priv *priv, const struct sk_buff *skb)
+{
+	u32 bitrate = priv->can.bittiming.bitrate;
+	u32 dbitrate = priv->can.data_bittiming.bitrate ? : bitrate;
+	u32 nbits, dbits;
+
+	vcan_frame_bits(skb, &nbits, &dbits);
+
+	return div_u64((u64)nbits * NSEC_PER_SEC, bitrate) +
+	       div_u64((u64)dbits * NSEC_PER_SEC, dbitrate);
+}
+
+/* fold the busy time of a finished frame into the bus load window */
+static void vcan_bus_account(struct vcan_priv *priv, ktime_t now, u64 wire_ns)
+{
+	s64 elapsed = ktime_to_ns(ktime_sub(now, priv->load_start));
+
+	priv->load_busy += wire_ns;
+	if (elapsed < NSEC_PER_SEC)
+		return;
+
+	priv->load_permille = min_t(u64, div64_u64(priv->load_busy * 1000, elapsed), 1000);
+	priv->load_stamp = now;
+	priv->load_start = now;
+	priv->load_busy = 0;
+}
+
+/*
+ * Bus timing emulation: the echo_skb slots of can_priv are the TX FIFO of
+ * a controller.  Every frame gets a completion time one wire time after
+ * the bus becomes free, the hrtimer completes them in order and only then
+ * are they echoed and delivered to peers.  The queues are stopped while
+ * the FIFO is full, which paces senders to the configured bitrate.
+ */
+/* the frame is taken, it gets its TX timestamp and is counted */
+static void vcan_tx_accept(struct vcan_priv *priv, struct sk_buff *skb)
+{
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+
+	/* SO_TIMESTAMPING software TX timestamp, "on the wire" is now */
+	skb_tx_timestamp(skb);
+	VCAN_SKB_CB(skb)->tx = READ_ONCE(priv->echo_lat_on) ? ktime_get_real() : 0;
+
+	vcan_stats_tx(priv, cfd->len);
+}
+
+static netdev_tx_t vcan_timed_xmit(struct sk_buff *skb, struct net_device *ndev,
+				   bool loop)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_txslot *slot;
+	unsigned int idx;
+	ktime_t now;
+
+	spin_lock(&priv->tx_lock);
+
+	/*
+	 * Stopping the queues does not hold back senders on other queues or
+	 * the generator that are already waiting for the lock.
+	 */
+	if (priv->tx_head - priv->tx_tail >= VCAN_FIFO_DEPTH) {
+		netif_tx_stop_all_queues(ndev);
+		spin_unlock(&priv->tx_lock);
+		return NETDEV_TX_BUSY;
+	}
+
+	vcan_tx_accept(priv, skb);
+
+	idx = priv->tx_head % VCAN_FIFO_DEPTH;
+	slot = &priv->tx[idx];
+	now = ktime_get();
+
+	if (ktime_before(priv->bus_free, now))
+		priv->bus_free = now;
+	slot->wire_ns = vcan_frame_time(priv, skb);
+	priv->bus_free = ktime_add_ns(priv->bus_free, slot->wire_ns);
+	slot->done = priv->bus_free;
+	slot->qid = skb_get_queue_mapping(skb);
+	slot->loop = loop;
+	slot->skb = NULL;
+
+	if (echo && loop)
+		can_put_echo_skb(skb, ndev, idx);
+	else
+		slot->skb = skb;
+
+	if (++priv->tx_head - priv->tx_tail == VCAN_FIFO_DEPTH)
+		netif_tx_stop_all_queues(ndev);
+	if (priv->tx_head - priv->tx_tail == 1)
+		hrtimer_start(&priv->tx_timer, slot->done, HRTIMER_MODE_ABS_SOFT);
+
+	spin_unlock(&priv->tx_lock);
+
+	return NETDEV_TX_OK;
+}
+
+static enum hrtimer_restart vcan_tx_timer(struct hrtimer *timer)
+{
+	struct vcan_priv *priv = container_of(timer, struct vcan_priv, tx_timer);
+	struct net_device *ndev = priv->ndev;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct vcan_txslot done[VCAN_FIFO_DEPTH];
+	unsigned int n = 0, i, idx, tail;
+	ktime_t now = ktime_get();
+	u8 len;
+
+	spin_lock(&priv->tx_lock);
+
+	tail = priv->tx_tail;
+	while (priv->tx_tail != priv->tx_head) {
+		idx = priv->tx_tail % VCAN_FIFO_DEPTH;
+		if (ktime_after(priv->tx[idx].done, now))
+			break;
+
+		done[n] = priv->tx[idx];
+		if (!done[n].skb)
+			done[n].skb = __can_get_echo_skb(ndev, idx, &len);
+		if (done[n].skb)
+			n++;
+
+		vcan_bus_account(priv, now, priv->tx[idx].wire_ns);
+		priv->tx_tail++;
+	}
+
+	if (priv->tx_tail != priv->tx_head) {
+		hrtimer_set_expires(timer, priv->tx[priv->tx_tail % VCAN_FIFO_DEPTH].done);
+		ret = HRTIMER_RESTART;
+	}
+
+	if (tail != priv->tx_tail && netif_running(ndev))
+		netif_tx_wake_all_queues(ndev);
+
+	spin_unlock(&priv->tx_lock);
+
+	rcu_read_lock_bh();
+	for (i = 0; i < n; i++)
+		vcan_tx_done(done[i].skb, ndev, done[i].qid, done[i].loop, NULL);
+	rcu_read_unlock_bh();
+
+	return ret;
+}
+
+/* drop whatever is still in flight, the device is going down */
+static void vcan_timed_flush(struct net_device *ndev)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	unsigned int idx;
+
+	hrtimer_cancel(&priv->tx_timer);
+
+	spin_lock_bh(&priv->tx_lock);
+	while (priv->tx_tail != priv->tx_head) {
+		idx = priv->tx_tail++ % VCAN_FIFO_DEPTH;
+		if (priv->tx[idx].skb)
+			kfree_skb(priv->tx[idx].skb);
+		else
+			can_free_echo_skb(ndev, idx);
+		priv->tx[idx].skb = NULL;
+	}
+	priv->load_permille = 0;
+	spin_unlock_bh(&priv->tx_lock);
+}
+
+/*
+ * End of an xmit_more burst: echo and deliver everything sent since the
+ * last flush, then report it completed to BQL in one go.
+ */
+static void vcan_tx_flush(struct net_device *ndev, unsigned int qid)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_rxq *rxq = &priv->rxq[qid];
+	unsigned int pkts = 0, bytes = 0;
+	struct vcan_burst burst;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&burst.rx);
+	__skb_queue_head_init(&burst.free);
+
+	while ((skb = __skb_dequeue(&rxq->burst))) {
+		pkts++;
+		bytes += skb->len;
+		vcan_tx_done(skb, ndev, qid, skb->pkt_type == PACKET_LOOPBACK, &burst);
+	}
+
+	vcan_rx_splice(ndev, qid, &burst);
+	netdev_tx_completed_queue(netdev_get_tx_queue(ndev, qid), pkts, bytes);
+}
+
+static netdev_tx_t vcan_start_xmit(struct sk_buff *skb,
+				   struct net_device *ndev)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	struct vcan_rxq *rxq;
+	unsigned int qid;
+	bool loop;
+
+	if (can_dropped_invalid_skb(ndev, skb)) {
+		vcan_stats_inc(priv, invalid);
+		return NETDEV_TX_OK;
+	}
+
+	/* set flag whether this packet has to be looped back */
+	loop = skb->pkt_type == PACKET_LOOPBACK;
+
+	if (priv->timed)
+		return vcan_timed_xmit(skb, ndev, loop);
+
+	vcan_tx_accept(priv, skb);
+
+	/*
+	 * Collect the burst, the stack tells us with xmit_more that more
+	 * frames follow.  BQL bounds the bytes held back, VCAN_BURST_MAX
+	 * the frames.
+	 */
+	qid = skb_get_queue_mapping(skb);
+	rxq = &priv->rxq[qid];
+	__skb_queue_tail(&rxq->burst, skb);
+	if (__netdev_tx_sent_queue(netdev_get_tx_queue(ndev, qid), skb->len,
+				   netdev_xmit_more()) ||
+	    skb_queue_len(&rxq->burst) >= VCAN_BURST_MAX)
+		vcan_tx_flush(ndev, qid);
+
+	return NETDEV_TX_OK;
+}
+
+/*
+ * Every TX queue has its own qdisc and xmit lock, so senders on different
+ * queues never serialize against each other.
+ */
+static u16 vcan_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     struct net_device *sb_dev)
+{
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+
+	if (vcan_queue_policy == VCAN_QUEUE_BY_ID)
+		return reciprocal_scale(jhash_1word(cfd->can_id, 0),
+					ndev->real_num_tx_queues);
+
+	return smp_processor_id() % ndev->real_num_tx_queues;
+}
+
+/* add up the per-CPU counters of @priv into @sum, syncp left untouched */
+static void vcan_stats_sum(struct vcan_priv *priv, struct vcan_pcpu_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		const struct vcan_pcpu_stats *s = per_cpu_ptr(priv->stats, cpu);
+		struct vcan_pcpu_stats v;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			v.rx_packets = s->rx_packets;
+			v.rx_bytes = s->rx_bytes;
+			v.tx_packets = s->tx_packets;
+			v.tx_bytes = s->tx_bytes;
+			v.rx_dropped = s->rx_dropped;
+			v.echo_clones = s->echo_clones;
+			v.invalid = s->invalid;
+			v.filtered = s->filtered;
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		sum->rx_packets += v.rx_packets;
+		sum->rx_bytes += v.rx_bytes;
+		sum->tx_packets += v.tx_packets;
+		sum->tx_bytes += v.tx_bytes;
+		sum->rx_dropped += v.rx_dropped;
+		sum->echo_clones += v.echo_clones;
+		sum->invalid += v.invalid;
+		sum->filtered += v.filtered;
+	}
+}
+
+static void vcan_get_stats64(struct net_device *ndev,
+			     struct rtnl_link_stats64 *stats)
+{
+	struct vcan_pcpu_stats sum;
+
+	vcan_stats_sum(netdev_priv(ndev), &sum);
+
+	stats->rx_packets = sum.rx_packets;
+	stats->rx_bytes = sum.rx_bytes;
+	stats->tx_packets = sum.tx_packets;
+	stats->tx_bytes = sum.tx_bytes;
+	stats->rx_dropped = sum.rx_dropped;
+	stats->tx_dropped = sum.invalid;
+}
+
+static const char vcan_stat_strings[][ETH_GSTRING_LEN] = {
+	"rx_packets",
+	"rx_bytes",
+	"tx_packets",
+	"tx_bytes",
+	"rx_dropped",
+	"echo_clones",
+	"invalid",
+	"filtered",
+};
+
+#define VCAN_NR_STATS ARRAY_SIZE(vcan_stat_strings)
+
+static int vcan_get_sset_count(struct net_device *ndev, int sset)
+{
+	return sset == ETH_SS_STATS ? VCAN_NR_STATS : -EOPNOTSUPP;
+}
+
+static void vcan_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, vcan_stat_strings, sizeof(vcan_stat_strings));
+}
+
+static void vcan_get_ethtool_stats(struct net_device *ndev,
+				   struct ethtool_stats *estats, u64 *data)
+{
+	struct vcan_pcpu_stats sum;
+
+	vcan_stats_sum(netdev_priv(ndev), &sum);
+
+	data[0] = sum.rx_packets;
+	data[1] = sum.rx_bytes;
+	data[2] = sum.tx_packets;
+	data[3] = sum.tx_bytes;
+	data[4] = sum.rx_dropped;
+	data[5] = sum.echo_clones;
+	data[6] = sum.invalid;
+	data[7] = sum.filtered;
+}
+
+static const struct ethtool_ops vcan_ethtool_ops = {
+	.get_sset_count = vcan_get_sset_count,
+	.get_strings = vcan_get_strings,
+	.get_ethtool_stats = vcan_get_ethtool_stats,
+	.get_ts_info = ethtool_op_get_ts_info,
 };
 
-struct platform_device *vcan_dev;
+/* cansend convention: 3 hex digits are a standard ID, 8 an extended one */
+static int vcan_parse_id(const char *tok, u32 *key)
+{
+	u32 id;
 
-static bool echo; /* echo testing. Default: 0 (Off) */
-module_param(echo, bool, S_IRUGO);
-MODULE_PARM_DESC(echo, "Echo sent frames (for testing). Default: 0 (Off)");
+	if (kstrtou32(tok, 16, &id))
+		return -EINVAL;
 
-static void vcan_rx(struct sk_buff *skb, struct net_device *ndev)
+	if (strlen(tok) == 8) {
+		if (id > CAN_EFF_MASK)
+			return -EINVAL;
+		*key = id | CAN_EFF_FLAG;
+	} else {
+		if (id > CAN_SFF_MASK)
+			return -EINVAL;
+		*key = id;
+	}
+
+	return 0;
+}
+
+static void vcan_filter_replace(struct vcan_priv *priv, struct vcan_filter *nf)
 {
-	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
-	struct net_device_stats *stats = &ndev->stats;
+	struct vcan_filter *old;
+
+	old = rcu_dereference_protected(priv->filter,
+					lockdep_is_held(&priv->filter_lock));
+	rcu_assign_pointer(priv->filter, nf);
+	if (old)
+		call_rcu(&old->rcu, vcan_filter_free_rcu);
+}
 
-	stats->rx_packets++;
-	stats->rx_bytes += cfd->len;
+static ssize_t filter_ids_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct vcan_priv *priv = netdev_priv(to_net_dev(dev));
+	const struct vcan_filter *f;
+	ssize_t len = 0;
+	unsigned int i;
 
-	skb->pkt_type  = PACKET_BROADCAST;
-	skb->dev       = ndev;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	rcu_read_lock();
+	f = rcu_dereference(priv->filter);
+	for (i = 0; f && i < f->nr_ids && len < PAGE_SIZE - 10; i++) {
+		u32 key = f->ids[i];
+
+		if (key & CAN_EFF_FLAG)
+			len += sprintf(buf + len, "%08X\n", key & CAN_EFF_MASK);
+		else
+			len += sprintf(buf + len, "%03X\n", key);
+	}
+	rcu_read_unlock();
 
-	netif_rx_ni(skb);
+	return len;
 }
 
-static netdev_tx_t vcan_start_xmit(struct sk_buff *skb,
-				   struct net_device *ndev)
+/*
+ * Whitespace separated tokens: "+ID" accepts ID, "-ID" stops accepting it,
+ * "clear" drops all IDs.  IDs are hex, 8 digits for extended frames.
+ */
+static ssize_t filter_ids_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
-	struct net_device_stats *stats = &ndev->stats;
-	int loop;
+	struct vcan_priv *priv = netdev_priv(to_net_dev(dev));
+	struct vcan_filter *old, *nf, *del;
+	char *str, *cur, *tok;
+	unsigned int nr_add = 0, nr_del = 0, keep, i;
+	bool clear = false;
+	u32 *add, key;
+	int err = 0;
 
-	if (can_dropped_invalid_skb(ndev, skb))
-		return NETDEV_TX_OK;
+	str = kstrndup(buf, count, GFP_KERNEL);
+	add = kmalloc_array(count, sizeof(u32), GFP_KERNEL);
+	del = vcan_filter_alloc(count);
+	if (!str || !add || !del) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	cur = str;
+	while ((tok = strsep(&cur, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		if (!strcmp(tok, "clear")) {
+			clear = true;
+			nr_add = 0;
+			continue;
+		}
+		if ((*tok != '+' && *tok != '-') || vcan_parse_id(tok + 1, &key)) {
+			err = -EINVAL;
+			goto out;
+		}
+		if (*tok == '+')
+			add[nr_add++] = key;
+		else
+			vcan_filter_add_id(del, key);
+	}
+	nr_del = del->nr_ids;
 
-	stats->tx_packets++;
-	stats->tx_bytes += cfd->len;
+	mutex_lock(&priv->filter_lock);
+	old = rcu_dereference_protected(priv->filter,
+					lockdep_is_held(&priv->filter_lock));
 
-	/* set flag whether this packet has to be looped back */
-	loop = skb->pkt_type == PACKET_LOOPBACK;
+	keep = (clear || !old) ? 0 : old->nr_ids;
+	if (keep + nr_add > VCAN_FILTER_MAX_IDS) {
+		mutex_unlock(&priv->filter_lock);
+		err = -ENOSPC;
+		goto out;
+	}
+
+	nf = vcan_filter_alloc(keep + nr_add);
+	if (!nf) {
+		mutex_unlock(&priv->filter_lock);
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (old) {
+		nf->nr_rules = old->nr_rules;
+		memcpy(nf->rules, old->rules, sizeof(old->rules));
+		for (i = 0; i < keep; i++)
+			if (!nr_del || !vcan_filter_has_id(del, old->ids[i]))
+				vcan_filter_add_id(nf, old->ids[i]);
+	}
+	for (i = 0; i < nr_add; i++)
+		if (!nr_del || !vcan_filter_has_id(del, add[i]))
+			vcan_filter_add_id(nf, add[i]);
+
+	vcan_filter_replace(priv, nf);
+	mutex_unlock(&priv->filter_lock);
+
+out:
+	kvfree(del);
+	kfree(add);
+	kfree(str);
+	return err ? err : count;
+}
+
+static DEVICE_ATTR_RW(filter_ids);
+
+static ssize_t filter_rules_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct vcan_priv *priv = netdev_priv(to_net_dev(dev));
+	const struct vcan_filter *f;
+	ssize_t len = 0;
+	unsigned int i;
+
+	rcu_read_lock();
+	f = rcu_dereference(priv->filter);
+	for (i = 0; f && i < f->nr_rules; i++) {
+		const struct vcan_filter_rule *r = &f->rules[i];
+
+		len += sprintf(buf + len, "%s %08X %08X\n",
+			       r->type == VCAN_RULE_MASK ? "mask" : "range",
+			       r->id, r->type == VCAN_RULE_MASK ? r->mask : r->last);
+	}
+	rcu_read_unlock();
+
+	return len;
+}
+
+/*
+ * One rule per write: "mask ID MASK" accepts IDs equal to ID in the MASK
+ * bits, "range FIRST LAST" accepts FIRST..LAST, "clear" drops all rules.
+ */
+static ssize_t filter_rules_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct vcan_priv *priv = netdev_priv(to_net_dev(dev));
+	struct vcan_filter_rule rule = { };
+	struct vcan_filter *old, *nf;
+	char type[8], a[12], b[12];
+	bool clear = false;
+	int n, err = 0;
+
+	n = sscanf(buf, "%7s %11s %11s", type, a, b);
+	if (n == 1 && !strcmp(type, "clear")) {
+		clear = true;
+	} else if (n == 3 && !strcmp(type, "mask")) {
+		rule.type = VCAN_RULE_MASK;
+		if (vcan_parse_id(a, &rule.id) || kstrtou32(b, 16, &rule.mask))
+			return -EINVAL;
+		rule.mask |= CAN_EFF_FLAG;
+	} else if (n == 3 && !strcmp(type, "range")) {
+		rule.type = VCAN_RULE_RANGE;
+		if (vcan_parse_id(a, &rule.id) || vcan_parse_id(b, &rule.last) ||
+		    rule.last < rule.id)
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+
+	mutex_lock(&priv->filter_lock);
+	old = rcu_dereference_protected(priv->filter,
+					lockdep_is_held(&priv->filter_lock));
+
+	if (!clear && old && old->nr_rules == VCAN_FILTER_MAX_RULES) {
+		err = -ENOSPC;
+		goto unlock;
+	}
+
+	nf = vcan_filter_alloc(old ? old->nr_ids : 0);
+	if (!nf) {
+		err = -ENOMEM;
+		goto unlock;
+	}
 
-	if (!echo) {
-		/* no echo handling available inside this driver */
+	if (old) {
+		unsigned int i;
 
-		if (loop) {
-			/*
-			 * only count the packets here, because the
-			 * CAN core already did the echo for us
-			 */
-			stats->rx_packets++;
-			stats->rx_bytes += cfd->len;
+		if (!clear) {
+			nf->nr_rules = old->nr_rules;
+			memcpy(nf->rules, old->rules, sizeof(old->rules));
 		}
-		consume_skb(skb);
-		return NETDEV_TX_OK;
+		for (i = 0; i < old->nr_ids; i++)
+			vcan_filter_add_id(nf, old->ids[i]);
 	}
+	if (!clear)
+		nf->rules[nf->nr_rules++] = rule;
 
-	/* perform standard echo handling for CAN network interfaces */
+	vcan_filter_replace(priv, nf);
+
+unlock:
+	mutex_unlock(&priv->filter_lock);
+	return err ? err : count;
+}
 
-	if (loop) {
+static DEVICE_ATTR_RW(filter_rules);
 
-		skb = can_create_echo_skb(skb);
-		if (!skb)
-			return NETDEV_TX_OK;
+static ssize_t bus_load_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct vcan_priv *priv = netdev_priv(to_net_dev(dev));
+	unsigned int load = 0;
+	ktime_t now = ktime_get();
+
+	spin_lock_bh(&priv->tx_lock);
+	/* a window older than two periods means the bus went idle */
+	if (priv->timed && ktime_to_ns(ktime_sub(now, priv->load_stamp)) < 2 * NSEC_PER_SEC)
+		load = priv->load_permille;
+	spin_unlock_bh(&priv->tx_lock);
+
+	return sprintf(buf, "%u.%u%%\n", load / 10, load % 10);
+}
+
+static DEVICE_ATTR_RO(bus_load);
+
+static struct attribute *vcan_attrs[] = {
+	&dev_attr_bus_load.attr,
+	&dev_attr_filter_ids.attr,
+	&dev_attr_filter_rules.attr,
+	NULL,
+};
+
+static const struct attribute_group vcan_attr_group = {
+	.attrs = vcan_attrs,
+};
+
+/*
+ * Traffic generator, the pktgen of this driver.  A kthread builds frames
+ * and hands them straight to ndo_start_xmit under the TX queue lock, so
+ * neither sockets nor the qdisc are measured.  Generated frames carry
+ * VCAN_GEN_MARK and their send time in skb->cb, vcan_poll() turns
+ * that into the latency histogram of the receiving interface.
+ */
+static struct dentry *vcan_debugfs;
 
-		/* receive with packet counting */
-		vcan_rx(skb, ndev);
+static struct sk_buff *vcan_gen_skb(struct vcan_priv *priv, u32 *next_id)
+{
+	struct vcan_gen *gen = &priv->gen;
+	struct canfd_frame *cfd;
+	struct sk_buff *skb;
+	u32 id;
+	u8 dlc;
+
+	if (gen->id_random) {
+		id = gen->id_lo + prandom_u32_max(gen->id_hi - gen->id_lo + 1);
 	} else {
-		/* no looped packets => no counting */
-		consume_skb(skb);
+		id = *next_id;
+		*next_id = id == gen->id_hi ? gen->id_lo : id + 1;
 	}
 
-	return NETDEV_TX_OK;
+	if (gen->dlc >= 0)
+		dlc = gen->dlc;
+	else
+		dlc = prandom_u32_max(gen->fd ? 16 : CAN_MAX_DLC + 1);
+
+	if (gen->fd) {
+		skb = alloc_canfd_skb(priv->ndev, &cfd);
+		if (!skb)
+			return NULL;
+		cfd->len = can_dlc2len(dlc);
+		if (gen->brs)
+			cfd->flags |= CANFD_BRS;
+	} else {
+		skb = alloc_can_skb(priv->ndev, (struct can_frame **)&cfd);
+		if (!skb)
+			return NULL;
+		cfd->len = min_t(u8, dlc, CAN_MAX_DLC);
+	}
+
+	cfd->can_id = gen->eff ? id | CAN_EFF_FLAG : id;
+	memset(cfd->data, 0x55, cfd->len);
+
+	/* sent by "us", so it gets echoed like a socket's frame */
+	skb->pkt_type = PACKET_LOOPBACK;
+	skb->mark = VCAN_GEN_MARK;
+	/* echo, RX and statistics follow the TX queue we send it on */
+	skb_set_queue_mapping(skb, gen->queue);
+
+	return skb;
+}
+
+/* wait until the next frame is due, false when told to stop */
+static bool vcan_gen_pace(struct vcan_gen *gen, u64 interval)
+{
+	u64 due = gen->start_ns + gen->sent * interval;
+	u64 now;
+
+	while ((now = ktime_get_ns()) < due) {
+		if (kthread_should_stop())
+			return false;
+		if (due - now > 100 * NSEC_PER_USEC)
+			usleep_range((due - now) / NSEC_PER_USEC - 50,
+				     (due - now) / NSEC_PER_USEC);
+		else
+			cpu_relax();
+	}
+
+	return true;
+}
+
+static int vcan_gen_thread(void *data)
+{
+	struct vcan_priv *priv = data;
+	struct vcan_gen *gen = &priv->gen;
+	struct net_device *ndev = priv->ndev;
+	struct netdev_queue *txq = netdev_get_tx_queue(ndev, gen->queue);
+	u64 interval = gen->rate ? div_u64(NSEC_PER_SEC, gen->rate) : 0;
+	struct sk_buff *skb = NULL;
+	u32 next_id = gen->id_lo;
+	netdev_tx_t ret;
+
+	while (!kthread_should_stop() && netif_running(ndev) &&
+	       (!gen->frames || gen->sent < gen->frames)) {
+		if (interval && !vcan_gen_pace(gen, interval))
+			break;
+
+		if (!skb) {
+			skb = vcan_gen_skb(priv, &next_id);
+			if (!skb) {
+				gen->alloc_fail++;
+				cond_resched();
+				continue;
+			}
+		}
+
+		local_bh_disable();
+		__netif_tx_lock(txq, smp_processor_id());
+		if (netif_xmit_frozen_or_stopped(txq)) {
+			ret = NETDEV_TX_BUSY;
+		} else {
+			VCAN_SKB_CB(skb)->sent = ktime_get_real();
+			ret = netdev_start_xmit(skb, ndev, txq, false);
+		}
+		__netif_tx_unlock(txq);
+		local_bh_enable();
+
+		if (ret == NETDEV_TX_OK) {
+			skb = NULL;
+			if (!(++gen->sent & 255))
+				cond_resched();
+		} else {
+			/* the bus timing FIFO is full, let it drain */
+			gen->busy++;
+			cond_resched();
+		}
+	}
+
+	kfree_skb(skb);
+	gen->end_ns = ktime_get_ns();
+	WRITE_ONCE(gen->running, false);
+
+	/* kthread_stop() wants us around until it is called */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static void vcan_gen_stop(struct vcan_priv *priv)
+{
+	struct vcan_gen *gen = &priv->gen;
+
+	mutex_lock(&gen->lock);
+	if (gen->task) {
+		kthread_stop(gen->task);
+		gen->task = NULL;
+		if (gen->running) {
+			/* stopped before the thread ever ran */
+			gen->end_ns = ktime_get_ns();
+			gen->running = false;
+		}
+	}
+	mutex_unlock(&gen->lock);
+}
+
+static int vcan_gen_start(struct vcan_priv *priv)
+{
+	struct vcan_gen *gen = &priv->gen;
+	struct net_device *ndev = priv->ndev;
+	struct task_struct *task;
+	u64 base[VCAN_NR_STATS];
+
+	if (!netif_running(ndev))
+		return -ENETDOWN;
+	if (gen->fd && ndev->mtu != CANFD_MTU)
+		return -EINVAL;
+	if (gen->queue >= priv->nr_queues || gen->id_lo > gen->id_hi ||
+	    gen->id_hi > (gen->eff ? CAN_EFF_MASK : CAN_SFF_MASK))
+		return -EINVAL;
+
+	/* reap the thread of a finished run */
+	if (gen->task) {
+		kthread_stop(gen->task);
+		gen->task = NULL;
+	}
+
+	vcan_get_ethtool_stats(ndev, NULL, base);
+	gen->dropped_base = base[4];
+	gen->filtered_base = base[7];
+	gen->sent = 0;
+	gen->busy = 0;
+	gen->alloc_fail = 0;
+	atomic64_set(&gen->received, 0);
+	vcan_hist_reset(&gen->lat);
+	gen->start_ns = ktime_get_ns();
+	gen->end_ns = 0;
+	gen->running = true;
+
+	task = kthread_run(vcan_gen_thread, priv, "vcan_gen/%s", ndev->name);
+	if (IS_ERR(task)) {
+		gen->running = false;
+		return PTR_ERR(task);
+	}
+	gen->task = task;
+
+	return 0;
+}
+
+static int vcan_gen_show(struct seq_file *m, void *v)
+{
+	struct vcan_priv *priv = m->private;
+	struct vcan_gen *gen = &priv->gen;
+	u64 stats[VCAN_NR_STATS];
+	u64 elapsed, sent;
+	bool running;
+
+	mutex_lock(&gen->lock);
+
+	seq_printf(m, "frames %llu rate %u ids %x-%x %s dlc ",
+		   gen->frames, gen->rate, gen->id_lo, gen->id_hi,
+		   gen->id_random ? "random" : "seq");
+	if (gen->dlc >= 0)
+		seq_printf(m, "%d", gen->dlc);
+	else
+		seq_puts(m, "random");
+	seq_printf(m, "%s%s%s queue %u\n", gen->eff ? " eff" : "",
+		   gen->fd ? " fd" : "", gen->brs ? " brs" : "", gen->queue);
+
+	running = READ_ONCE(gen->running);
+	sent = READ_ONCE(gen->sent);
+	if (gen->start_ns) {
+		elapsed = (running ? ktime_get_ns() : gen->end_ns) - gen->start_ns;
+		vcan_get_ethtool_stats(priv->ndev, NULL, stats);
+
+		seq_printf(m, "%s: sent %llu busy %llu alloc_fail %llu in %llu us, %llu frames/s\n",
+			   running ? "running" : "done", sent, READ_ONCE(gen->busy),
+			   READ_ONCE(gen->alloc_fail), div_u64(elapsed, NSEC_PER_USEC),
+			   elapsed ? div64_u64(sent * NSEC_PER_SEC, elapsed) : 0);
+		seq_printf(m, "received %lld rx_dropped %llu filtered %llu\n",
+			   (long long)atomic64_read(&gen->received),
+			   stats[4] - gen->dropped_base, stats[7] - gen->filtered_base);
+		seq_puts(m, "latency send -> receive:\n");
+		vcan_hist_show(m, &gen->lat);
+	}
+
+	mutex_unlock(&gen->lock);
+
+	return 0;
+}
+
+static int vcan_gen_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vcan_gen_show, inode->i_private);
+}
+
+/*
+ * "frames=N rate=N ids=LO-HI dist=seq|random dlc=N|random queue=N
+ *  [eff|sff] [fd|classic] [brs|nobrs] [start|stop]", IDs in hex
+ */
+static int vcan_gen_parse(struct vcan_gen *gen, char *tok)
+{
+	char *val = strchr(tok, '=');
+	int ret = 0;
+
+	if (val)
+		*val++ = '\0';
+
+	if (!strcmp(tok, "frames") && val)
+		ret = kstrtou64(val, 0, &gen->frames);
+	else if (!strcmp(tok, "rate") && val)
+		ret = kstrtou32(val, 0, &gen->rate);
+	else if (!strcmp(tok, "queue") && val)
+		ret = kstrtouint(val, 0, &gen->queue);
+	else if (!strcmp(tok, "ids") && val)
+		ret = sscanf(val, "%x-%x", &gen->id_lo, &gen->id_hi) == 2 ? 0 : -EINVAL;
+	else if (!strcmp(tok, "dist") && val)
+		gen->id_random = !strcmp(val, "random");
+	else if (!strcmp(tok, "dlc") && val && !strcmp(val, "random"))
+		gen->dlc = -1;
+	else if (!strcmp(tok, "dlc") && val)
+		ret = kstrtoint(val, 0, &gen->dlc) ?:
+		      (gen->dlc < 0 || gen->dlc > 15 ? -EINVAL : 0);
+	else if (!strcmp(tok, "eff") || !strcmp(tok, "sff"))
+		gen->eff = tok[0] == 'e';
+	else if (!strcmp(tok, "fd") || !strcmp(tok, "classic"))
+		gen->fd = tok[0] == 'f';
+	else if (!strcmp(tok, "brs") || !strcmp(tok, "nobrs"))
+		gen->brs = tok[0] == 'b';
+	else
+		ret = -EINVAL;
+
+	return ret;
+}
+
+static ssize_t vcan_gen_write(struct file *file, const char __user *ubuf,
+			      size_t count, loff_t *ppos)
+{
+	struct vcan_priv *priv = ((struct seq_file *)file->private_data)->private;
+	struct vcan_gen *gen = &priv->gen;
+	char *buf, *p, *tok;
+	int ret = 0;
+
+	buf = memdup_user_nul(ubuf, min_t(size_t, count, PAGE_SIZE - 1));
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	/* stop first, so "stop frames=..." works on a running generator */
+	if (strstr(buf, "stop"))
+		vcan_gen_stop(priv);
+
+	mutex_lock(&gen->lock);
+	p = buf;
+	while (!ret && (tok = strsep(&p, " \t\n"))) {
+		if (!*tok || !strcmp(tok, "stop"))
+			continue;
+		if (!strcmp(tok, "start"))
+			ret = gen->running ? -EBUSY : vcan_gen_start(priv);
+		else if (gen->running)
+			ret = -EBUSY;
+		else
+			ret = vcan_gen_parse(gen, tok);
+	}
+	mutex_unlock(&gen->lock);
+
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+static const struct file_operations vcan_gen_fops = {
+	.owner = THIS_MODULE,
+	.open = vcan_gen_open,
+	.read = seq_read,
+	.write = vcan_gen_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Echo latency: time from ndo_start_xmit to the echo reaching vcan_poll(),
+ * i.e. the driver's share of a socket's TX -> own RX round trip.  Off by
+ * default, writing 1 resets and enables it, 0 disables it.
+ */
+static int vcan_echo_lat_show(struct seq_file *m, void *v)
+{
+	struct vcan_priv *priv = m->private;
+
+	seq_printf(m, "%s\n", READ_ONCE(priv->echo_lat_on) ? "on" : "off");
+	vcan_hist_show(m, &priv->echo_lat);
+
+	return 0;
+}
+
+static int vcan_echo_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vcan_echo_lat_show, inode->i_private);
+}
+
+static ssize_t vcan_echo_lat_write(struct file *file, const char __user *ubuf,
+				   size_t count, loff_t *ppos)
+{
+	struct vcan_priv *priv = ((struct seq_file *)file->private_data)->private;
+	bool on;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, count, &on);
+	if (ret)
+		return ret;
+
+	if (on && !priv->echo_lat_on)
+		vcan_hist_reset(&priv->echo_lat);
+	WRITE_ONCE(priv->echo_lat_on, on);
+
+	return count;
+}
+
+static const struct file_operations vcan_echo_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = vcan_echo_lat_open,
+	.read = seq_read,
+	.write = vcan_echo_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void vcan_gen_init(struct vcan_priv *priv)
+{
+	struct vcan_gen *gen = &priv->gen;
+
+	mutex_init(&gen->lock);
+	gen->frames = 100000;
+	gen->id_hi = CAN_SFF_MASK;
+	gen->dlc = CAN_MAX_DLC;
+}
+
+/* bitrates accepted by "ip link set canX type can bitrate N [dbitrate M]" */
+static const u32 vcan_bitrates[] = {
+	10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000,
+};
+
+static const u32 vcan_data_bitrates[] = {
+	1000000, 2000000, 4000000, 5000000, 8000000,
+};
+
+static int vcan_set_bittiming(struct net_device *ndev)
+{
+	/* nothing to program, the rate is read from can_priv at open */
+	return 0;
+}
+
+static int vcan_open(struct net_device *ndev)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	unsigned int i;
+
+	priv->timed = priv->can.bittiming.bitrate != 0;
+	priv->bus_free = ktime_get();
+	priv->load_start = priv->bus_free;
+	priv->load_stamp = priv->bus_free;
+	priv->load_busy = 0;
+
+	for (i = 0; i < priv->nr_queues; i++) {
+		netdev_tx_reset_queue(netdev_get_tx_queue(ndev, i));
+		napi_enable(&priv->rxq[i].napi);
+	}
+	netif_tx_start_all_queues(ndev);
+
+	return 0;
+}
+
+static int vcan_stop(struct net_device *ndev)
+{
+	struct vcan_priv *priv = netdev_priv(ndev);
+	unsigned int i;
+
+	vcan_gen_stop(priv);
+	netif_tx_stop_all_queues(ndev);
+	vcan_timed_flush(ndev);
+	for (i = 0; i < priv->nr_queues; i++) {
+		napi_disable(&priv->rxq[i].napi);
+		skb_queue_purge(&priv->rxq[i].skbs);
+		__skb_queue_purge(&priv->rxq[i].burst);
+		__skb_queue_purge(&priv->rxq[i].free);
+	}
+
+	return 0;
 }
 
 static int vcan_change_mtu(struct net_device *ndev, int new_mtu)
@@ -99,17 +1704,28 @@ static int vcan_change_mtu(struct net_device *ndev, int new_mtu)
 }
 
 static const struct net_device_ops vcan_netdev_ops = {
+	.ndo_open = vcan_open,
+	.ndo_stop = vcan_stop,
 	.ndo_start_xmit = vcan_start_xmit,
+	.ndo_select_queue = vcan_select_queue,
+	.ndo_get_stats64 = vcan_get_stats64,
 	.ndo_change_mtu = vcan_change_mtu,
 };
 
-static int vcan_probe(struct platform_device *pdev)
+static struct net_device *vcan_create(struct platform_device *pdev,
+				      struct vcan_fabric *fabric,
+				      unsigned int index)
 {
 	struct net_device *ndev;
 	struct vcan_priv *priv;
+	unsigned int nr_queues, i;
 	int err = -ENODEV;
 
-	ndev = alloc_candev(sizeof(struct vcan_priv), VCAN_FIFO_DEPTH);
+	nr_queues = queues ? queues : num_online_cpus();
+	nr_queues = clamp_t(unsigned int, nr_queues, 1, VCAN_MAX_QUEUES);
+
+	ndev = alloc_candev_mqs(sizeof(struct vcan_priv), VCAN_FIFO_DEPTH,
+				nr_queues, nr_queues);
 	if (!ndev) {
 		dev_err(&pdev->dev, "alloc_candev() failed\n");
 		err = -ENOMEM;
@@ -117,34 +1733,132 @@ static int vcan_probe(struct platform_device *pdev)
 	}
 
 	priv = netdev_priv(ndev);
+	priv->stats = netdev_alloc_pcpu_stats(struct vcan_pcpu_stats);
+	if (!priv->stats) {
+		err = -ENOMEM;
+		goto fail_candev;
+	}
+
 	ndev->netdev_ops = &vcan_netdev_ops;
+	ndev->ethtool_ops = &vcan_ethtool_ops;
 	ndev->flags |= IFF_ECHO;
 	priv->ndev = ndev;
-	platform_set_drvdata(pdev, ndev);
+	priv->fabric = fabric;
+	priv->index = index;
+	mutex_init(&priv->filter_lock);
+	vcan_gen_init(priv);
+	priv->can.bitrate_const = vcan_bitrates;
+	priv->can.bitrate_const_cnt = ARRAY_SIZE(vcan_bitrates);
+	priv->can.data_bitrate_const = vcan_data_bitrates;
+	priv->can.data_bitrate_const_cnt = ARRAY_SIZE(vcan_data_bitrates);
+	priv->can.do_set_bittiming = vcan_set_bittiming;
+	priv->can.do_set_data_bittiming = vcan_set_bittiming;
+	priv->can.ctrlmode_supported = CAN_CTRLMODE_FD;
+	spin_lock_init(&priv->tx_lock);
+	hrtimer_init(&priv->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	priv->tx_timer.function = vcan_tx_timer;
+	priv->nr_queues = nr_queues;
+	for (i = 0; i < nr_queues; i++) {
+		skb_queue_head_init(&priv->rxq[i].skbs);
+		__skb_queue_head_init(&priv->rxq[i].burst);
+		__skb_queue_head_init(&priv->rxq[i].free);
+		netif_napi_add(ndev, &priv->rxq[i].napi, vcan_poll, VCAN_NAPI_WEIGHT);
+	}
+	ndev->sysfs_groups[0] = &vcan_attr_group;
 	SET_NETDEV_DEV(ndev, &pdev->dev);
 	
 	err = register_candev(ndev);
 	if (err) {
 		dev_err(&pdev->dev, "register_candev() failed, error %d\n", err);
-		goto fail_candev;
+		goto fail_stats;
 	}
 
-	dev_info(&pdev->dev, "device registered\n");
-	return 0;
+	priv->debugfs = debugfs_create_dir(netdev_name(ndev), vcan_debugfs);
+	debugfs_create_file("gen", S_IRUGO | S_IWUSR, priv->debugfs, priv,
+			    &vcan_gen_fops);
+	debugfs_create_file("echo_latency", S_IRUGO | S_IWUSR, priv->debugfs, priv,
+			    &vcan_echo_lat_fops);
+
+	netdev_info(ndev, "registered, %u queues selected by %s\n",
+		    nr_queues, vcan_queue_policy == VCAN_QUEUE_BY_ID ? "id" : "cpu");
+	return ndev;
 
+fail_stats:
+	free_percpu(priv->stats);
 fail_candev:
 	free_candev(ndev);
 
 fail:
-	return err;
+	return ERR_PTR(err);
 }
 
-static int vcan_remove(struct platform_device *pdev)
+static void vcan_destroy(struct net_device *ndev)
 {
-	struct net_device *ndev = platform_get_drvdata(pdev);
+	struct vcan_priv *priv = netdev_priv(ndev);
+	unsigned int i;
 
+	/* no new runs can be started once the file is gone */
+	debugfs_remove_recursive(priv->debugfs);
 	unregister_candev(ndev);
+	for (i = 0; i < priv->nr_queues; i++)
+		netif_napi_del(&priv->rxq[i].napi);
+	/* unregister waited for all readers */
+	kvfree(rcu_dereference_protected(priv->filter, 1));
+	free_percpu(priv->stats);
 	free_candev(ndev);
+}
+
+static void vcan_fabric_teardown(struct vcan_fabric *fabric)
+{
+	struct net_device *ndev[VCAN_MAX_IFACES];
+	unsigned int i;
+
+	/* unlink everyone first, so no xmit can reach a dying peer */
+	for (i = 0; i < fabric->nr; i++) {
+		ndev[i] = rcu_dereference_protected(fabric->ndev[i], 1);
+		RCU_INIT_POINTER(fabric->ndev[i], NULL);
+	}
+	synchronize_rcu();
+
+	for (i = 0; i < fabric->nr; i++)
+		if (ndev[i])
+			vcan_destroy(ndev[i]);
+}
+
+static int vcan_probe(struct platform_device *pdev)
+{
+	struct vcan_fabric *fabric;
+	struct net_device *ndev;
+	unsigned int i;
+
+	fabric = devm_kzalloc(&pdev->dev, struct_size(fabric, ndev, nr_ifaces),
+			      GFP_KERNEL);
+	if (!fabric)
+		return -ENOMEM;
+
+	fabric->nr = nr_ifaces;
+	fabric->topology = vcan_topology;
+	platform_set_drvdata(pdev, fabric);
+
+	for (i = 0; i < nr_ifaces; i++) {
+		ndev = vcan_create(pdev, fabric, i);
+		if (IS_ERR(ndev)) {
+			vcan_fabric_teardown(fabric);
+			return PTR_ERR(ndev);
+		}
+		rcu_assign_pointer(fabric->ndev[i], ndev);
+	}
+
+	dev_info(&pdev->dev, "%u interfaces registered, topology %s\n",
+		 nr_ifaces, topology);
+	return 0;
+}
+
+static int vcan_remove(struct platform_device *pdev)
+{
+	struct vcan_fabric *fabric = platform_get_drvdata(pdev);
+
+	vcan_fabric_teardown(fabric);
 
 	dev_info(&pdev->dev, "device removed\n");
 	return 0;
@@ -163,20 +1877,45 @@ static int __init vcan_init(void)
 {
 	int retval;
 
+	if (!strcmp(queue_by, "id"))
+		vcan_queue_policy = VCAN_QUEUE_BY_ID;
+	else if (strcmp(queue_by, "cpu"))
+		return -EINVAL;
+
+	if (!strcmp(topology, "bus"))
+		vcan_topology = VCAN_TOPO_BUS;
+	else if (!strcmp(topology, "pair"))
+		vcan_topology = VCAN_TOPO_PAIR;
+	else if (strcmp(topology, "loop"))
+		return -EINVAL;
+
+	if (!nr_ifaces || nr_ifaces > VCAN_MAX_IFACES)
+		return -EINVAL;
+
+	vcan_debugfs = debugfs_create_dir("vcan", NULL);
+
 	vcan_dev = platform_device_alloc("vcan", -1);
-	if (!vcan_dev)
-		return -ENOMEM;
+	if (!vcan_dev) {
+		retval = -ENOMEM;
+		goto fail_debugfs;
+	}
 
 	retval = platform_device_add(vcan_dev);
 	if (retval < 0) {
 		platform_device_put(vcan_dev);
-		return retval;
+		goto fail_debugfs;
 	}
 
 	retval = platform_driver_register(&vcan_driver);
-	if (retval < 0)
+	if (retval < 0) {
 		platform_device_unregister(vcan_dev);
+		goto fail_debugfs;
+	}
+
+	return 0;
 
+fail_debugfs:
+	debugfs_remove_recursive(vcan_debugfs);
 	return retval;
 }
 
@@ -184,6 +1923,9 @@ static void __exit vcan_exit(void)
 {
 	platform_driver_unregister(&vcan_driver);
 	platform_device_unregister(vcan_dev);
+	debugfs_remove_recursive(vcan_debugfs);
+	/* filters replaced through sysfs may still wait for their grace period */
+	rcu_barrier();
 }
 
 module_init(vcan_init);